@@ -51,6 +51,12 @@
 // However lots of PGA's may mean more
 #define QUEUE	100
 
+// Number of clients served at the same time
+#define API_MAX_CLIENTS	0x40
+
+// Seconds a client may stay idle before being disconnected
+#define API_CLIENT_TIMEOUT	30
+
 static const char *UNAVAILABLE = " - API will not be available";
 static const char *MUNAVAILABLE = " - API multicast listener will not be available";
 
@@ -185,6 +191,7 @@ static const char ISJSON = '{';
 
 static const char *JSON_COMMAND = "command";
 static const char *JSON_PARAMETER = "parameter";
+static const char *JSON_ENCODING = "encoding";
 
 #define MSG_INVGPU 1
 #define MSG_ALRENA 2
@@ -314,6 +321,8 @@ static const char *JSON_PARAMETER = "parameter";
 
 #define MSG_INVSTRATEGY 0x102
 #define MSG_FAILPORT 0x103
+#define MSG_SUBSCRIBED 0x104
+#define MSG_INVSUB 0x105
 
 #define USE_ALTMSG 0x4000
 
@@ -485,6 +494,8 @@ struct CODES {
  { SEVERITY_SUCC,  MSG_ZERNOSUM, PARAM_STR,	"Zeroed %s stats without summary" },
  { SEVERITY_SUCC,  MSG_DEVSCAN, PARAM_COUNT,	"Added %d new device(s)" },
  { SEVERITY_SUCC,  MSG_BYE,		PARAM_STR,	"%s" },
+ { SEVERITY_SUCC,  MSG_SUBSCRIBED,	PARAM_STR,	"Subscribed to %s events" },
+ { SEVERITY_ERR,   MSG_INVSUB,	PARAM_STR,	"Invalid subscription '%s'" },
  { SEVERITY_FAIL, 0, 0, NULL }
 };
 
@@ -531,8 +542,35 @@ struct io_data {
 	
 	// Whether to add various things
 	bool close;
+	
+	// Reply to the current request is to be sent as CBOR
+	bool cbor;
+	
+	// Event classes (enum api_event_class) pushed to this client
+	int subscriptions;
+	int devices_interval;
+	time_t last_devices_event;
+	// Devices events only carry changes, so each client starts from a full list
+	bool devices_need_full;
 };
-static struct io_data *rpc_io_data;
+
+struct api_client {
+	struct io_data *io_data;
+	char group;
+	char connectaddr[0x10];
+	time_t last_active;
+	
+	// Received data not yet processed
+	char buf[TMPBUFSIZ];
+	size_t buflen;
+	
+	// Disconnect once the pending reply is sent
+	bool done;
+};
+static struct api_client *api_clients[API_MAX_CLIENTS];
+
+// Limit to how much unsent data (replies or events) a client may build up before being dropped
+#define API_CLIENT_MAX_BACKLOG  (RPC_SOCKBUFSIZ * 0x10)
 
 static void io_reinit(struct io_data *io_data)
 {
@@ -597,6 +635,143 @@ size_t io_flush(struct io_data *io_data, bool complete)
 	return sent;
 }
 
+static
+void cbor_put_head(bytes_t * const b, const uint8_t major, const uint64_t n)
+{
+	uint8_t buf[9];
+	int sz, i;
+	
+	if (n < 24)
+	{
+		buf[0] = (major << 5) | n;
+		bytes_append(b, buf, 1);
+		return;
+	}
+	if (n <= 0xff)
+		sz = 1;
+	else
+	if (n <= 0xffff)
+		sz = 2;
+	else
+	if (n <= 0xffffffff)
+		sz = 4;
+	else
+		sz = 8;
+	// Additional information 24-27 means a 1, 2, 4 or 8 byte argument follows
+	buf[0] = (major << 5) | (24 + (sz == 1 ? 0 : sz == 2 ? 1 : sz == 4 ? 2 : 3));
+	for (i = 0; i < sz; ++i)
+		buf[1 + i] = n >> (8 * (sz - 1 - i));
+	bytes_append(b, buf, 1 + sz);
+}
+
+static
+void cbor_put_json(bytes_t * const b, json_t * const j)
+{
+	switch (json_typeof(j))
+	{
+		case JSON_OBJECT:
+			cbor_put_head(b, 5, json_object_size(j));
+			for (void *iter = json_object_iter(j); iter; iter = json_object_iter_next(j, iter))
+			{
+				const char * const key = json_object_iter_key(iter);
+				const size_t keylen = strlen(key);
+				cbor_put_head(b, 3, keylen);
+				bytes_append(b, key, keylen);
+				cbor_put_json(b, json_object_iter_value(iter));
+			}
+			break;
+		case JSON_ARRAY:
+		{
+			const size_t sz = json_array_size(j);
+			cbor_put_head(b, 4, sz);
+			for (size_t i = 0; i < sz; ++i)
+				cbor_put_json(b, json_array_get(j, i));
+			break;
+		}
+		case JSON_STRING:
+		{
+			const char * const str = json_string_value(j);
+			const size_t len = strlen(str);
+			cbor_put_head(b, 3, len);
+			bytes_append(b, str, len);
+			break;
+		}
+		case JSON_INTEGER:
+		{
+			const json_int_t v = json_integer_value(j);
+			if (v >= 0)
+				cbor_put_head(b, 0, v);
+			else
+				cbor_put_head(b, 1, -1 - v);
+			break;
+		}
+		case JSON_REAL:
+		{
+			const double d = json_real_value(j);
+			uint64_t u;
+			uint8_t buf[9];
+			memcpy(&u, &d, sizeof(u));
+			buf[0] = 0xfb;  // double precision float
+			for (int i = 0; i < 8; ++i)
+				buf[1 + i] = u >> (8 * (7 - i));
+			bytes_append(b, buf, sizeof(buf));
+			break;
+		}
+		case JSON_TRUE:
+			bytes_append(b, "\xf5", 1);
+			break;
+		case JSON_FALSE:
+			bytes_append(b, "\xf4", 1);
+			break;
+		case JSON_NULL:
+			bytes_append(b, "\xf6", 1);
+			break;
+	}
+}
+
+static
+void cbor_put_string(bytes_t * const b, const char * const str)
+{
+	const size_t len = strlen(str);
+	cbor_put_head(b, 3, len);
+	bytes_append(b, str, len);
+}
+
+static
+void cbor_put_int(bytes_t * const b, const int64_t v)
+{
+	if (v >= 0)
+		cbor_put_head(b, 0, v);
+	else
+		cbor_put_head(b, 1, -1 - v);
+}
+
+static
+void cbor_put_double(bytes_t * const b, const double d)
+{
+	uint8_t buf[9];
+	uint64_t u;
+	
+	memcpy(&u, &d, sizeof(u));
+	buf[0] = 0xfb;  // double precision float
+	for (int i = 0; i < 8; ++i)
+		buf[1 + i] = u >> (8 * (7 - i));
+	bytes_append(b, buf, sizeof(buf));
+}
+
+static
+void cbor_put_float(bytes_t * const b, const float f)
+{
+	uint8_t buf[5];
+	uint32_t u;
+	
+	memcpy(&u, &f, sizeof(u));
+	buf[0] = 0xfa;  // single precision float
+	for (int i = 0; i < 4; ++i)
+		buf[1 + i] = u >> (8 * (3 - i));
+	bytes_append(b, buf, sizeof(buf));
+}
+
 static bool io_add(struct io_data *io_data, char *buf)
 {
 	size_t len = strlen(buf);
@@ -606,16 +781,69 @@ static bool io_add(struct io_data *io_data, char *buf)
 	return true;
 }
 
+/* The reply structure around print_data's objects is added with these, which
+ * write CBOR directly (using indefinite length maps and arrays) when the
+ * request asked for it */
+
+// Opens the reply object
+static void io_add_start(struct io_data *io_data)
+{
+	if (io_data->cbor)
+		bytes_append(&io_data->data, "\xbf", 1);
+	else
+		io_add(io_data, JSON_START);
+}
+
+// Opens a named section: ,"name":[ in JSON, or name, in plain text
+static bool io_add_section(struct io_data *io_data, bool isjson, bool precom, const char *name)
+{
+	if (io_data->cbor)
+	{
+		cbor_put_string(&io_data->data, name);
+		bytes_append(&io_data->data, "\x9f", 1);
+		return true;
+	}
+	if (isjson)
+	{
+		io_add(io_data, precom ? COMSTR JSON1 : JSON1);
+		io_add(io_data, (char *)name);
+		return io_add(io_data, JSON2);
+	}
+	io_add(io_data, (char *)name);
+	return io_add(io_data, COMSTR);
+}
+
+static void io_add_close(struct io_data *io_data)
+{
+	if (io_data->cbor)
+		bytes_append(&io_data->data, "\xff", 1);
+	else
+		io_add(io_data, JSON_CLOSE);
+}
+
+// Adds the reply id, and closes the reply object
+static void io_add_end(struct io_data *io_data)
+{
+	if (io_data->cbor)
+	{
+		cbor_put_string(&io_data->data, "id");
+		cbor_put_int(&io_data->data, 1);
+		bytes_append(&io_data->data, "\xff", 1);
+	}
+	else
+		io_add(io_data, JSON_END);
+}
+
 static void io_close(struct io_data *io_data)
 {
 	io_data->close = true;
 }
 
-static void io_free()
+static
+void io_free(struct io_data * const io_data)
 {
-	bytes_free(&rpc_io_data->data);
-	free(rpc_io_data);
-	rpc_io_data = NULL;
+	bytes_free(&io_data->data);
+	free(io_data);
 }
 
 // This is only called when expected to be needed (rarely)
@@ -946,12 +1174,89 @@ struct api_data *api_add_percent(struct api_data * const root, const char * cons
 	return api_add_data_full(root, name, API_PERCENT, data, copy_data);
 }
 
-static struct api_data *print_data(struct api_data *root, char *buf, bool isjson, bool precom)
+// Encodes an api_data item natively, according to its type
+static
+void cbor_put_api_data(bytes_t * const b, const struct api_data * const item)
+{
+	cbor_put_string(b, item->name);
+	switch (item->type)
+	{
+		case API_STRING:
+		case API_CONST:
+		case API_ESCAPE:
+			cbor_put_string(b, item->data);
+			break;
+		case API_UINT8:
+			cbor_put_head(b, 0, *(uint8_t *)item->data);
+			break;
+		case API_INT16:
+			cbor_put_int(b, *(int16_t *)item->data);
+			break;
+		case API_UINT16:
+			cbor_put_head(b, 0, *(uint16_t *)item->data);
+			break;
+		case API_INT:
+			cbor_put_int(b, *(int *)item->data);
+			break;
+		case API_UINT:
+			cbor_put_head(b, 0, *(unsigned int *)item->data);
+			break;
+		case API_UINT32:
+			cbor_put_head(b, 0, *(uint32_t *)item->data);
+			break;
+		case API_UINT64:
+			cbor_put_head(b, 0, *(uint64_t *)item->data);
+			break;
+		case API_TIME:
+			cbor_put_head(b, 0, *(unsigned long *)item->data);
+			break;
+		case API_ELAPSED:
+			cbor_put_int(b, *(double *)item->data);
+			break;
+		case API_DOUBLE:
+		case API_UTILITY:
+		case API_FREQ:
+		case API_MHS:
+		case API_MHTOTAL:
+		case API_HS:
+		case API_DIFF:
+			cbor_put_double(b, *(double *)item->data);
+			break;
+		case API_PERCENT:
+			cbor_put_double(b, *(double *)item->data * 100.0);
+			break;
+		case API_VOLTS:
+		case API_TEMP:
+			cbor_put_float(b, *(float *)item->data);
+			break;
+		case API_BOOL:
+			bytes_append(b, *(bool *)item->data ? "\xf5" : "\xf4", 1);
+			break;
+		case API_TIMEVAL:
+		{
+			const struct timeval * const tv = item->data;
+			cbor_put_double(b, (double)tv->tv_sec + (double)tv->tv_usec / 1000000.);
+			break;
+		}
+		case API_JSON:
+			cbor_put_json(b, (json_t *)item->data);
+			break;
+		default:
+			applog(LOG_ERR, "API: unknown2 data type %d ignored", item->type);
+			cbor_put_string(b, UNKNOWN);
+			break;
+	}
+}
+
+// Adds (and frees) the items as one object in the reply
+static struct api_data *print_data(struct io_data * const io_data, struct api_data *root, bool isjson, bool precom)
 {
 	struct api_data *tmp;
 	bool first = true;
 	char *original, *escape;
 	char *quote;
+	char bufstart[TMPBUFSIZ], *buf = bufstart;
+	const bool cbor = io_data->cbor;
 
 	*buf = '\0';
 
@@ -960,6 +1265,9 @@ static struct api_data *print_data(struct api_data *root, char *buf, bool isjson
 		*buf = '\0';
 	}
 
+	if (cbor)
+		bytes_append(&io_data->data, "\xbf", 1);
+	else
 	if (isjson) {
 		strcpy(buf, JSON0);
 		buf = strchr(buf, '\0');
@@ -968,6 +1276,12 @@ static struct api_data *print_data(struct api_data *root, char *buf, bool isjson
 		quote = (char *)BLANK;
 
 	while (root) {
+		if (cbor)
+		{
+			cbor_put_api_data(&io_data->data, root);
+			goto next;
+		}
+		
 		if (!first)
 			*(buf++) = *COMMA;
 		else
@@ -1069,6 +1383,7 @@ static struct api_data *print_data(struct api_data *root, char *buf, bool isjson
 
 		buf = strchr(buf, '\0');
 
+next:
 		free(root->name);
 		if (root->type == API_JSON)
 			json_decref((json_t *)root->data);
@@ -1087,7 +1402,13 @@ static struct api_data *print_data(struct api_data *root, char *buf, bool isjson
 		}
 	}
 
+	if (cbor)
+	{
+		bytes_append(&io_data->data, "\xff", 1);
+		return root;
+	}
 	strcpy(buf, isjson ? JSON5 : SEPSTR);
+	io_add(io_data, bufstart);
 
 	return root;
 }
@@ -1139,7 +1460,6 @@ static void message(struct io_data * const io_data, const int messageid2, const
 {
 	struct api_data *root = NULL;
 	char buf[TMPBUFSIZ];
-	char buf2[TMPBUFSIZ];
 	char severity[2];
 #ifdef HAVE_AN_FPGA
 	int pga;
@@ -1151,7 +1471,10 @@ static void message(struct io_data * const io_data, const int messageid2, const
 	int messageid = messageid2 & ~USE_ALTMSG;
 
 	if (isjson)
-		io_add(io_data, JSON_START JSON_STATUS);
+	{
+		io_add_start(io_data);
+		io_add_section(io_data, true, false, _STATUS);
+	}
 
 	for (i = 0; codes[i].severity != SEVERITY_FAIL; i++) {
 		if (codes[i].code == messageid2) {
@@ -1242,10 +1565,9 @@ static void message(struct io_data * const io_data, const int messageid2, const
 			root = api_add_escape(root, "Msg", buf, false);
 			root = api_add_escape(root, "Description", opt_api_description, false);
 
-			root = print_data(root, buf2, isjson, false);
-			io_add(io_data, buf2);
+			root = print_data(io_data, root, isjson, false);
 			if (isjson)
-				io_add(io_data, JSON_CLOSE);
+				io_add_close(io_data);
 			return;
 		}
 	}
@@ -1258,27 +1580,24 @@ static void message(struct io_data * const io_data, const int messageid2, const
 	root = api_add_escape(root, "Msg", buf, false);
 	root = api_add_escape(root, "Description", opt_api_description, false);
 
-	root = print_data(root, buf2, isjson, false);
-	io_add(io_data, buf2);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson)
-		io_add(io_data, JSON_CLOSE);
+		io_add_close(io_data);
 }
 
 static void apiversion(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 
 	message(io_data, MSG_VERSION, 0, NULL, isjson);
-	io_open = io_add(io_data, isjson ? COMSTR JSON_VERSION : _VERSION COMSTR);
+	io_open = io_add_section(io_data, isjson, true, _VERSION);
 
 	root = api_add_string(root, "Miner", bfgminer_name_space_ver, false);
 	root = api_add_string(root, "CGMiner", bfgminer_ver, false);
 	root = api_add_const(root, "API", APIVERSION, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -1311,7 +1630,7 @@ static void minerconfig(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __
 #endif
 
 	message(io_data, MSG_MINECONFIG, 0, NULL, isjson);
-	io_open = io_add(io_data, isjson ? COMSTR JSON_MINECONFIG : _MINECONFIG COMSTR);
+	io_open = io_add_section(io_data, isjson, true, _MINECONFIG);
 
 	root = api_add_int(root, "PGA Count", &pgacount, false);
 	root = api_add_int(root, "Pool Count", &total_pools, false);
@@ -1355,8 +1674,7 @@ static void minerconfig(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __
 		root = api_add_string(root, buf, configfile->filename, false);
 	}
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -1426,7 +1744,6 @@ int find_index_by_cgpu(struct cgpu_info *cgpu)
 static void devdetail_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson, bool precom)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	int n;
 
 	cgpu_utility(cgpu);
@@ -1457,8 +1774,7 @@ static void devdetail_an(struct io_data *io_data, struct cgpu_info *cgpu, bool i
 	if ((per_proc || cgpu->procs <= 1) && cgpu->drv->get_api_extra_device_detail)
 		root = api_add_extra(root, cgpu->drv->get_api_extra_device_detail(cgpu));
 
-	root = print_data(root, buf, isjson, precom);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, precom);
 }
 
 static
@@ -1466,7 +1782,6 @@ void devstatus_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson,
 {
 	struct cgpu_info *proc;
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	int n;
 
 	n = find_index_by_cgpu(cgpu);
@@ -1561,8 +1876,7 @@ void devstatus_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson,
 	if ((per_proc || cgpu->procs <= 1) && cgpu->drv->get_api_extra_device_status)
 		root = api_add_extra(root, cgpu->drv->get_api_extra_device_status(cgpu));
 
-	root = print_data(root, buf, isjson, precom);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, precom);
 }
 
 #ifdef USE_OPENCL
@@ -1608,7 +1922,7 @@ devinfo_internal(void (*func)(struct io_data *, struct cgpu_info*, bool, bool),
 
 	message(io_data, msg, 0, NULL, isjson);
 	if (isjson)
-		io_open = io_add(io_data, COMSTR JSON_DEVS);
+		io_open = io_add_section(io_data, true, true, _DEVS);
 
 	for (i = 0; i < total_devices; ++i) {
 		cgpu = get_devices(i);
@@ -1655,7 +1969,7 @@ static void gpudev(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *p
 	message(io_data, MSG_GPUDEV, id, NULL, isjson);
 
 	if (isjson)
-		io_open = io_add(io_data, COMSTR JSON_GPU);
+		io_open = io_add_section(io_data, true, true, _GPU);
 
 	gpustatus(io_data, id, isjson, false);
 
@@ -1679,7 +1993,7 @@ static void devscan(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 	
 	message(io_data, MSG_DEVSCAN, n, NULL, isjson);
 	
-	io_open = io_add(io_data, isjson ? COMSTR JSON_DEVS : _DEVS COMSTR);
+	io_open = io_add_section(io_data, isjson, true, _DEVS);
 
 	n = total_devices - n;
 	for (int i = n; i < total_devices; ++i)
@@ -1731,7 +2045,7 @@ static void pgadev(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *p
 	message(io_data, MSG_PGADEV, id, NULL, isjson);
 
 	if (isjson)
-		io_open = io_add(io_data, COMSTR JSON_PGA);
+		io_open = io_add_section(io_data, true, true, _PGA);
 
 	pgastatus(io_data, id, isjson, false);
 
@@ -1874,7 +2188,7 @@ static void cpudev(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *p
 	message(io_data, MSG_CPUDEV, id, NULL, isjson);
 
 	if (isjson)
-		io_open = io_add(io_data, COMSTR JSON_CPU);
+		io_open = io_add_section(io_data, true, true, _CPU);
 
 	cpustatus(io_data, id, isjson, false);
 
@@ -1886,7 +2200,6 @@ static void cpudev(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *p
 static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open = false;
 	char *status, *lp;
 	int i;
@@ -1899,7 +2212,7 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 	message(io_data, MSG_POOL, 0, NULL, isjson);
 
 	if (isjson)
-		io_open = io_add(io_data, COMSTR JSON_POOLS);
+		io_open = io_add_section(io_data, true, true, _POOLS);
 
 	for (i = 0; i < total_pools; i++) {
 		struct pool *pool = pools[i];
@@ -1967,6 +2280,7 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		else
 			root = api_add_const(root, "Stratum URL", BLANK, false);
 		root = api_add_diff(root, "Best Share", &(pool->best_diff), true);
+		root = api_add_double(root, "Probe RTT", &(pool->probe_rtt), true);
 		if (pool->admin_msg)
 			root = api_add_escape(root, "Message", pool->admin_msg, true);
 		double rejp = (pool->diff_accepted + pool->diff_rejected + pool->diff_stale) ?
@@ -1976,32 +2290,81 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 				(double)(pool->diff_stale) / (double)(pool->diff_accepted + pool->diff_rejected + pool->diff_stale) : 0;
 		root = api_add_percent(root, "Pool Stale%", &stalep, false);
 
-		root = print_data(root, buf, isjson, isjson && (i > 0));
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, isjson && (i > 0));
 	}
 
 	if (isjson && io_open)
 		io_close(io_data);
 }
 
+// Totals copied together under hash_lock, so summary can be formatted without holding it
+struct api_summary_snapshot {
+	double total_secs;
+	double total_mhashes_done;
+	double total_rolling;
+	unsigned int found_blocks;
+	int total_getworks;
+	int total_accepted;
+	int total_rejected;
+	int hw_errors;
+	int total_discarded;
+	int total_stale;
+	unsigned int total_go;
+	unsigned int local_work;
+	unsigned int total_ro;
+	unsigned int new_blocks;
+	double total_diff1;
+	double total_bad_diff1;
+	double total_diff_accepted;
+	double total_diff_rejected;
+	double total_diff_stale;
+	double best_diff;
+	time_t last_getwork;
+};
+
 static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	double utility, mhs, work_utility;
+	struct api_summary_snapshot snap;
 
 	message(io_data, MSG_SUMM, 0, NULL, isjson);
-	io_open = io_add(io_data, isjson ? COMSTR JSON_SUMMARY : _SUMMARY COMSTR);
+	io_open = io_add_section(io_data, isjson, true, _SUMMARY);
 
 	// stop hashmeter() changing some while copying
 	mutex_lock(&hash_lock);
+	snap = (struct api_summary_snapshot){
+		.total_secs = total_secs,
+		.total_mhashes_done = total_mhashes_done,
+		.total_rolling = total_rolling,
+		.found_blocks = found_blocks,
+		.total_getworks = total_getworks,
+		.total_accepted = total_accepted,
+		.total_rejected = total_rejected,
+		.hw_errors = hw_errors,
+		.total_discarded = total_discarded,
+		.total_stale = total_stale,
+		.total_go = total_go,
+		.local_work = local_work,
+		.total_ro = total_ro,
+		.new_blocks = new_blocks,
+		.total_diff1 = total_diff1,
+		.total_bad_diff1 = total_bad_diff1,
+		.total_diff_accepted = total_diff_accepted,
+		.total_diff_rejected = total_diff_rejected,
+		.total_diff_stale = total_diff_stale,
+		.best_diff = best_diff,
+		.last_getwork = last_getwork,
+	};
+	mutex_unlock(&hash_lock);
 
-	utility = total_accepted / ( total_secs ? total_secs : 1 ) * 60;
-	mhs = total_mhashes_done / total_secs;
-	work_utility = total_diff1 / ( total_secs ? total_secs : 1 ) * 60;
+	// NOTE: snap outlives root, so nothing needs to be copied
+	utility = snap.total_accepted / ( snap.total_secs ? snap.total_secs : 1 ) * 60;
+	mhs = snap.total_mhashes_done / snap.total_secs;
+	work_utility = snap.total_diff1 / ( snap.total_secs ? snap.total_secs : 1 ) * 60;
 
-	root = api_add_elapsed(root, "Elapsed", &(total_secs), true);
+	root = api_add_elapsed(root, "Elapsed", &snap.total_secs, false);
 #if defined(USE_CPUMINING) && defined(USE_SHA256D)
 	if (opt_n_threads > 0)
 		root = api_add_string(root, "Algorithm", (algo_names[opt_algo] ?: NULLSTR), false);
@@ -2009,44 +2372,40 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 	root = api_add_mhs(root, "MHS av", &(mhs), false);
 	char mhsname[27];
 	sprintf(mhsname, "MHS %ds", opt_log_interval);
-	root = api_add_mhs(root, mhsname, &(total_rolling), false);
-	root = api_add_uint(root, "Found Blocks", &(found_blocks), true);
-	root = api_add_int(root, "Getworks", &(total_getworks), true);
-	root = api_add_int(root, "Accepted", &(total_accepted), true);
-	root = api_add_int(root, "Rejected", &(total_rejected), true);
-	root = api_add_int(root, "Hardware Errors", &(hw_errors), true);
+	root = api_add_mhs(root, mhsname, &snap.total_rolling, false);
+	root = api_add_uint(root, "Found Blocks", &snap.found_blocks, false);
+	root = api_add_int(root, "Getworks", &snap.total_getworks, false);
+	root = api_add_int(root, "Accepted", &snap.total_accepted, false);
+	root = api_add_int(root, "Rejected", &snap.total_rejected, false);
+	root = api_add_int(root, "Hardware Errors", &snap.hw_errors, false);
 	root = api_add_utility(root, "Utility", &(utility), false);
-	root = api_add_int(root, "Discarded", &(total_discarded), true);
-	root = api_add_int(root, "Stale", &(total_stale), true);
-	root = api_add_uint(root, "Get Failures", &(total_go), true);
-	root = api_add_uint(root, "Local Work", &(local_work), true);
-	root = api_add_uint(root, "Remote Failures", &(total_ro), true);
-	root = api_add_uint(root, "Network Blocks", &(new_blocks), true);
-	root = api_add_mhtotal(root, "Total MH", &(total_mhashes_done), true);
-	root = api_add_diff(root, "Diff1 Work", &total_diff1, true);
+	root = api_add_int(root, "Discarded", &snap.total_discarded, false);
+	root = api_add_int(root, "Stale", &snap.total_stale, false);
+	root = api_add_uint(root, "Get Failures", &snap.total_go, false);
+	root = api_add_uint(root, "Local Work", &snap.local_work, false);
+	root = api_add_uint(root, "Remote Failures", &snap.total_ro, false);
+	root = api_add_uint(root, "Network Blocks", &snap.new_blocks, false);
+	root = api_add_mhtotal(root, "Total MH", &snap.total_mhashes_done, false);
+	root = api_add_diff(root, "Diff1 Work", &snap.total_diff1, false);
 	root = api_add_utility(root, "Work Utility", &(work_utility), false);
-	root = api_add_diff(root, "Difficulty Accepted", &(total_diff_accepted), true);
-	root = api_add_diff(root, "Difficulty Rejected", &(total_diff_rejected), true);
-	root = api_add_diff(root, "Difficulty Stale", &(total_diff_stale), true);
-	root = api_add_diff(root, "Best Share", &(best_diff), true);
-	double hwp = (total_bad_diff1 + total_diff1) ?
-			(double)(total_bad_diff1) / (double)(total_bad_diff1 + total_diff1) : 0;
+	root = api_add_diff(root, "Difficulty Accepted", &snap.total_diff_accepted, false);
+	root = api_add_diff(root, "Difficulty Rejected", &snap.total_diff_rejected, false);
+	root = api_add_diff(root, "Difficulty Stale", &snap.total_diff_stale, false);
+	root = api_add_diff(root, "Best Share", &snap.best_diff, false);
+	double hwp = (snap.total_bad_diff1 + snap.total_diff1) ?
+			(double)(snap.total_bad_diff1) / (double)(snap.total_bad_diff1 + snap.total_diff1) : 0;
 	root = api_add_percent(root, "Device Hardware%", &hwp, false);
-	double rejp = total_diff1 ?
-			(double)(total_diff_rejected) / (double)(total_diff1) : 0;
+	double rejp = snap.total_diff1 ?
+			(double)(snap.total_diff_rejected) / (double)(snap.total_diff1) : 0;
 	root = api_add_percent(root, "Device Rejected%", &rejp, false);
-	double prejp = (total_diff_accepted + total_diff_rejected + total_diff_stale) ?
-			(double)(total_diff_rejected) / (double)(total_diff_accepted + total_diff_rejected + total_diff_stale) : 0;
+	const double wtotal = snap.total_diff_accepted + snap.total_diff_rejected + snap.total_diff_stale;
+	double prejp = wtotal ? (double)(snap.total_diff_rejected) / wtotal : 0;
 	root = api_add_percent(root, "Pool Rejected%", &prejp, false);
-	double stalep = (total_diff_accepted + total_diff_rejected + total_diff_stale) ?
-			(double)(total_diff_stale) / (double)(total_diff_accepted + total_diff_rejected + total_diff_stale) : 0;
+	double stalep = wtotal ? (double)(snap.total_diff_stale) / wtotal : 0;
 	root = api_add_percent(root, "Pool Stale%", &stalep, false);
-	root = api_add_time(root, "Last getwork", &last_getwork, false);
+	root = api_add_time(root, "Last getwork", &snap.last_getwork, false);
 
-	mutex_unlock(&hash_lock);
-
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2152,7 +2511,6 @@ static void gpurestart(struct io_data *io_data, __maybe_unused SOCKETTYPE c, cha
 static void gpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	int numgpu = 0;
 
@@ -2161,12 +2519,11 @@ static void gpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 #endif
 
 	message(io_data, MSG_NUMGPU, 0, NULL, isjson);
-	io_open = io_add(io_data, isjson ? COMSTR JSON_GPUS : _GPUS COMSTR);
+	io_open = io_add_section(io_data, isjson, true, _GPUS);
 
 	root = api_add_int(root, "Count", &numgpu, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2174,7 +2531,6 @@ static void gpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 static void pgacount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	int count = 0;
 
@@ -2183,12 +2539,11 @@ static void pgacount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 #endif
 
 	message(io_data, MSG_NUMPGA, 0, NULL, isjson);
-	io_open = io_add(io_data, isjson ? COMSTR JSON_PGAS : _PGAS COMSTR);
+	io_open = io_add_section(io_data, isjson, true, _PGAS);
 
 	root = api_add_int(root, "Count", &count, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2297,7 +2652,6 @@ static void cpurestart(struct io_data *io_data, __maybe_unused SOCKETTYPE c, cha
 static void cpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	int count = 0;
 
@@ -2306,12 +2660,11 @@ static void cpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 #endif
 
 	message(io_data, MSG_NUMCPU, 0, NULL, isjson);
-	io_open = io_add(io_data, isjson ? COMSTR JSON_CPUS : _CPUS COMSTR);
+	io_open = io_add_section(io_data, isjson, true, _CPUS);
 
 	root = api_add_int(root, "Count", &count, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2813,7 +3166,6 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 {
 	struct cgpu_info *proc;
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	char *reason;
 	
 	time_t last_not_well = 0;
@@ -2900,8 +3252,7 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 	root = api_add_int(root, "*Dev Comms Error", &dev_comms_error_count, false);
 	root = api_add_int(root, "*Dev Throttle", &dev_throttle_count, false);
 
-	root = print_data(root, buf, isjson, isjson && (device > 0));
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, isjson && (device > 0));
 }
 
 static
@@ -2919,7 +3270,7 @@ void notify(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused
 	message(io_data, MSG_NOTIFY, 0, NULL, isjson);
 
 	if (isjson)
-		io_open = io_add(io_data, COMSTR JSON_NOTIFY);
+		io_open = io_add_section(io_data, true, true, _NOTIFY);
 
 	for (i = 0; i < total_devices; i++) {
 		cgpu = get_devices(i);
@@ -2965,7 +3316,6 @@ void dosave(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, b
 static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_stats *stats, struct cgminer_pool_stats *pool_stats, struct api_data *extra, bool isjson)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	double elapsed;
 
 	root = api_add_int(root, "STATS", &i, false);
@@ -2999,13 +3349,15 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_st
 		root = api_add_uint64(root, "Bytes Recv", &(pool_stats->bytes_received), false);
 		root = api_add_uint64(root, "Net Bytes Sent", &(pool_stats->net_bytes_sent), false);
 		root = api_add_uint64(root, "Net Bytes Recv", &(pool_stats->net_bytes_received), false);
+		root = api_add_uint32(root, "Template Txns", &(pool_stats->template_txns), false);
+		root = api_add_uint64(root, "Template Bytes", &(pool_stats->template_bytes), false);
+		root = api_add_double(root, "Template Fetch Time", &(pool_stats->template_fetch_time), false);
 	}
 
 	if (extra)
 		root = api_add_extra(root, extra);
 
-	root = print_data(root, buf, isjson, isjson && (i > 0));
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, isjson && (i > 0));
 
 	return ++i;
 }
@@ -3021,7 +3373,7 @@ static void minerstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 	message(io_data, MSG_MINESTATS, 0, NULL, isjson);
 
 	if (isjson)
-		io_open = io_add(io_data, COMSTR JSON_MINESTATS);
+		io_open = io_add_section(io_data, true, true, _MINESTATS);
 
 	i = 0;
 	for (j = 0; j < total_devices; j++) {
@@ -3081,11 +3433,11 @@ static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 	HASH_ITER(hh, mining_goals, goal, tmpgoal)
 	{
 		if (goal->is_default)
-			io_add(io_data, isjson ? COMSTR JSON1 _MINECOIN JSON2 : _MINECOIN COMSTR);
+			io_add_section(io_data, isjson, true, _MINECOIN);
 		else
 		{
-			sprintf(buf, isjson ? COMSTR JSON1 _MINECOIN "%u" JSON2 : _MINECOIN "%u" COMSTR, goal->id);
-			io_add(io_data, buf);
+			sprintf(buf, _MINECOIN "%u", goal->id);
+			io_add_section(io_data, isjson, true, buf);
 		}
 		
 		switch (goal->malgo->algo)
@@ -3119,17 +3471,15 @@ static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 		
 		root = api_add_diff(root, "Difficulty Accepted", &goal->diff_accepted, false);
 		
-		root = print_data(root, buf, isjson, precom);
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, precom);
 		if (isjson)
-			io_add(io_data, JSON_CLOSE);
+			io_add_close(io_data);
 	}
 }
 
 static void debugstate(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 
 	if (param == NULL)
@@ -3189,7 +3539,7 @@ static void debugstate(struct io_data *io_data, __maybe_unused SOCKETTYPE c, cha
 	}
 
 	message(io_data, MSG_DEBUGSET, 0, NULL, isjson);
-	io_open = io_add(io_data, isjson ? COMSTR JSON_DEBUGSET : _DEBUGSET COMSTR);
+	io_open = io_add_section(io_data, isjson, true, _DEBUGSET);
 
 	root = api_add_bool(root, "Silent", &opt_realquiet, false);
 	root = api_add_bool(root, "Quiet", &opt_quiet, false);
@@ -3199,8 +3549,7 @@ static void debugstate(struct io_data *io_data, __maybe_unused SOCKETTYPE c, cha
 	root = api_add_bool(root, "PerDevice", &want_per_device_stats, false);
 	root = api_add_bool(root, "WorkTime", &opt_worktime, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -3406,6 +3755,214 @@ static void dozero(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *p
 		message(io_data, MSG_ZERNOSUM, 0, all ? "All" : "BestShare", isjson);
 }
 
+struct api_event {
+	enum api_event_class class;
+	// Devices events: every device, rather than only those that changed
+	bool full;
+	char *msg;
+	struct api_event *next;
+};
+
+// Union of all clients' subscriptions, so producers can skip unwanted events cheaply
+int api_subscribed_events;
+static pthread_mutex_t api_events_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct api_event *api_events, **api_events_tail = &api_events;
+static notifier_t api_events_notifier;
+
+// Set by the API thread when a devices subscriber needs a full list next time
+static bool api_devices_want_full;
+
+// Last device values sent in devices events (protected by api_devices_mutex)
+struct api_device_last {
+	double mhs;
+	float temp;
+};
+static pthread_mutex_t api_devices_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct api_device_last *api_devices_last;
+static int api_devices_last_count;
+
+static
+void api_event_push2(const enum api_event_class class, char * const msg, const bool full)
+{
+	struct api_event * const ev = malloc(sizeof(*ev));
+	if (unlikely(!ev))
+		quithere(1, "Failed to malloc event");
+	*ev = (struct api_event){
+		.class = class,
+		.full = full,
+		.msg = msg,
+	};
+	mutex_lock(&api_events_mutex);
+	*api_events_tail = ev;
+	api_events_tail = &ev->next;
+	mutex_unlock(&api_events_mutex);
+	notifier_wake(api_events_notifier);
+}
+#define api_event_push(class, msg)  api_event_push2(class, msg, false)
+
+/* Sends only the devices whose (rounded) hashrate or temperature changed since
+ * the last devices event, or every device when a subscriber needs the full list */
+void api_event_devices(void)
+{
+	bytes_t buf = BYTES_INIT;
+	char tmp[0x100];
+	struct cgpu_info *proc;
+	struct api_device_last *last;
+	bool full, any = false;
+	int i, count;
+	
+	if (!(api_subscribed_events & APIEV_DEVICES))
+		return;
+	
+	mutex_lock(&api_devices_mutex);
+	full = api_devices_want_full;
+	api_devices_want_full = false;
+	count = total_devices;
+	if (count > api_devices_last_count)
+	{
+		// New devices always count as changed
+		api_devices_last = realloc(api_devices_last, count * sizeof(*api_devices_last));
+		if (unlikely(!api_devices_last))
+			quithere(1, "Failed to realloc api_devices_last");
+		for (i = api_devices_last_count; i < count; ++i)
+			api_devices_last[i] = (struct api_device_last){ .mhs = -1, .temp = -1, };
+		api_devices_last_count = count;
+	}
+	
+	snprintf(tmp, sizeof(tmp), "{\"event\":\"devices\",\"when\":%lu,\"full\":%s,\"devices\":[", (unsigned long)time(NULL), full ? "true" : "false");
+	bytes_append(&buf, tmp, strlen(tmp));
+	for (i = 0; i < count; ++i)
+	{
+		proc = get_devices(i);
+		last = &api_devices_last[i];
+		if (!(full || fabs(proc->rolling - last->mhs) >= .0005 || fabsf(proc->temp - last->temp) >= .05))
+			continue;
+		last->mhs = proc->rolling;
+		last->temp = proc->temp;
+		snprintf(tmp, sizeof(tmp), "%s{\"id\":\"%s\",\"mhs\":%.3f,\"temp\":%.1f}",
+		         any ? COMMA : BLANK, proc->proc_repr_ns, proc->rolling, proc->temp);
+		bytes_append(&buf, tmp, strlen(tmp));
+		any = true;
+	}
+	mutex_unlock(&api_devices_mutex);
+	bytes_append(&buf, "]}", 3);
+	if (!(full || any))
+	{
+		bytes_free(&buf);
+		return;
+	}
+	api_event_push2(APIEV_DEVICES, (char *)bytes_buf(&buf), full);
+}
+
+void api_event_share(const struct cgpu_info * const proc, const struct work * const work, const char * const result)
+{
+	char *msg;
+	
+	if (!(api_subscribed_events & APIEV_SHARES))
+		return;
+	
+	msg = malloc(0x100);
+	if (unlikely(!msg))
+		quithere(1, "Failed to malloc event");
+	snprintf(msg, 0x100, "{\"event\":\"share\",\"when\":%lu,\"id\":\"%s\",\"pool\":%d,\"result\":\"%s\",\"diff\":%f}",
+	         (unsigned long)time(NULL), proc->proc_repr_ns, work->pool->pool_no, result, work->work_difficulty);
+	api_event_push(APIEV_SHARES, msg);
+}
+
+void api_event_pool_switch(struct pool * const pool)
+{
+	char *url, *msg;
+	size_t sz;
+	
+	if (!(api_subscribed_events & APIEV_POOLS))
+		return;
+	
+	url = escape_string(pool->rpc_url, true);
+	sz = strlen(url) + 0x80;
+	msg = malloc(sz);
+	if (unlikely(!msg))
+		quithere(1, "Failed to malloc event");
+	snprintf(msg, sz, "{\"event\":\"pool\",\"when\":%lu,\"pool\":%d,\"url\":\"%s\"}",
+	         (unsigned long)time(NULL), pool->pool_no, url);
+	if (url != pool->rpc_url)
+		free(url);
+	api_event_push(APIEV_POOLS, msg);
+}
+
+void api_event_block(const struct mining_goal_info * const goal, const struct block_info * const blkinfo)
+{
+	char hexstr[65], *goalname, *msg;
+	size_t sz;
+	
+	if (!(api_subscribed_events & APIEV_BLOCKS))
+		return;
+	
+	blkhashstr(hexstr, blkinfo->prevblkhash);
+	goalname = escape_string(goal->name, true);
+	sz = strlen(goalname) + 0xc0;
+	msg = malloc(sz);
+	if (unlikely(!msg))
+		quithere(1, "Failed to malloc event");
+	snprintf(msg, sz, "{\"event\":\"block\",\"when\":%lu,\"goal\":\"%s\",\"height\":%lu,\"hash\":\"%s\"}",
+	         (unsigned long)time(NULL), goalname, (unsigned long)blkinfo->height, hexstr);
+	if (goalname != goal->name)
+		free(goalname);
+	api_event_push(APIEV_BLOCKS, msg);
+}
+
+static const char * const api_event_class_names[] = {
+	"devices",
+	"shares",
+	"pools",
+	"blocks",
+};
+
+/* subscribe|class[,class...][,N]
+ * Keeps the connection open, sending each event as a null-terminated JSON
+ * object; N limits devices events to one per N seconds */
+static void subscribe(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
+{
+	int subscriptions = 0, interval = 0, i;
+	char buf[TMPBUFSIZ], names[0x40] = "";
+	char *p, *next;
+	
+	snprintf(buf, sizeof(buf), "%s", (param && *param) ? param : "devices,shares,pools,blocks");
+	for (p = buf; p; p = next)
+	{
+		next = strchr(p, ',');
+		if (next)
+			*(next++) = '\0';
+		if (isdigit(*p))
+		{
+			interval = atoi(p);
+			continue;
+		}
+		for (i = 0; i < (int)(sizeof(api_event_class_names) / sizeof(*api_event_class_names)); ++i)
+			if (!strcasecmp(p, api_event_class_names[i]))
+				break;
+		if (i == (int)(sizeof(api_event_class_names) / sizeof(*api_event_class_names)))
+		{
+			message(io_data, MSG_INVSUB, 0, p, isjson);
+			return;
+		}
+		if (!(subscriptions & (1 << i)))
+			tailsprintf(names, sizeof(names), "%s%s", names[0] ? COMMA : BLANK, api_event_class_names[i]);
+		subscriptions |= 1 << i;
+	}
+	if (!subscriptions)
+	{
+		message(io_data, MSG_INVSUB, 0, param, isjson);
+		return;
+	}
+	
+	io_data->subscriptions = subscriptions;
+	io_data->devices_interval = interval;
+	io_data->last_devices_event = 0;
+	io_data->devices_need_full = true;
+	api_subscribed_events |= subscriptions;
+	message(io_data, MSG_SUBSCRIBED, 0, names, isjson);
+}
+
 static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, char group);
 
 struct CMDS {
@@ -3481,13 +4038,13 @@ struct CMDS {
 	{ "procset",		pgaset,		true,	false },
 #endif
 	{ "zero",		dozero,		true,	false },
+	{ "subscribe",		subscribe,	false,	false },
 	{ NULL,			NULL,		false,	false }
 };
 
 static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	char cmdbuf[100];
 	bool found, access;
@@ -3513,13 +4070,12 @@ static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, c
 	}
 
 	message(io_data, MSG_CHECK, 0, NULL, isjson);
-	io_open = io_add(io_data, isjson ? COMSTR JSON_CHECK : _CHECK COMSTR);
+	io_open = io_add_section(io_data, isjson, true, _CHECK);
 
 	root = api_add_const(root, "Exists", found ? YES : NO, false);
 	root = api_add_const(root, "Access", access ? YES : NO, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -3528,23 +4084,20 @@ static void head_join(struct io_data *io_data, char *cmdptr, bool isjson, bool *
 {
 	char *ptr;
 
+	const bool precom = !*firstjoin;
+
 	if (*firstjoin) {
 		if (isjson)
-			io_add(io_data, JSON0);
+			io_add_start(io_data);
 		*firstjoin = false;
-	} else {
-		if (isjson)
-			io_add(io_data, JSON_BETWEEN_JOIN);
 	}
 
-	// External supplied string
-	ptr = escape_string(cmdptr, isjson);
+	// External supplied string, which CBOR needs no escaping for
+	ptr = io_data->cbor ? cmdptr : escape_string(cmdptr, isjson);
 
-	if (isjson) {
-		io_add(io_data, JSON1);
-		io_add(io_data, ptr);
-		io_add(io_data, JSON2);
-	} else {
+	if (isjson)
+		io_add_section(io_data, true, precom, ptr);
+	else {
 		io_add(io_data, JOIN_CMD);
 		io_add(io_data, ptr);
 		io_add(io_data, BETWEEN_JOIN);
@@ -3557,37 +4110,41 @@ static void head_join(struct io_data *io_data, char *cmdptr, bool isjson, bool *
 static void tail_join(struct io_data *io_data, bool isjson)
 {
 	if (io_data->close) {
-		io_add(io_data, JSON_CLOSE);
+		io_add_close(io_data);
 		io_data->close = false;
 	}
 
 	if (isjson) {
-		io_add(io_data, JSON_END);
-		io_add(io_data, JSON3);
+		io_add_end(io_data);
+		io_add_close(io_data);
 	}
 }
 
 static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 {
 	if (io_data->close)
-		io_add(io_data, JSON_CLOSE);
+		io_add_close(io_data);
 	
 	if (isjson)
-		io_add(io_data, JSON_END);
+		io_add_end(io_data);
 	
-	// Null-terminate reply, including sending the \0 on the socket
-	bytes_append(&io_data->data, "", 1);
-	
-	applog(LOG_DEBUG, "API: send reply: (%ld) '%.10s%s'",
-	       (long)bytes_len(&io_data->data),
-	       bytes_buf(&io_data->data),
-	       bytes_len(&io_data->data) > 10 ? "..." : BLANK);
-	
-	io_flush(io_data, true);
+	if (io_data->cbor)
+		// CBOR data items are self-delimiting, so need no terminator
+		applog(LOG_DEBUG, "API: send CBOR reply");
+	else
+	{
+		// Null-terminate reply, including sending the \0 on the socket
+		bytes_append(&io_data->data, "", 1);
+		
+		applog(LOG_DEBUG, "API: send reply: (%ld) '%.10s%s'",
+		       (long)bytes_len(&io_data->data),
+		       bytes_buf(&io_data->data),
+		       bytes_len(&io_data->data) > 10 ? "..." : BLANK);
+	}
+	io_data->cbor = false;
 	
-	if (bytes_len(&io_data->data))
-		applog(LOG_WARNING, "RPC: Timed out with %ld bytes left to send",
-		       (long)bytes_len(&io_data->data));
+	// Whatever can't be sent now is sent by the API loop when the socket is writable
+	io_flush(io_data, false);
 }
 
 static
@@ -3609,6 +4166,23 @@ void tidyup_socket(void * const arg)
 	mutex_unlock(&quit_restart_lock);
 }
 
+static
+void api_client_close(const int i)
+{
+	struct api_client * const client = api_clients[i];
+	struct io_data * const io_data = client->io_data;
+	
+	applog(LOG_DEBUG, "API: closing connection from %s", client->connectaddr);
+	// Last chance for a pending reply (eg, to quit or restart)
+	if (bytes_len(&io_data->data))
+		io_flush(io_data, true);
+	shutdown(io_data->sock, SHUT_RDWR);
+	CLOSESOCKET(io_data->sock);
+	io_free(io_data);
+	free(client);
+	api_clients[i] = NULL;
+}
+
 static void tidyup(__maybe_unused void *arg)
 {
 	mutex_lock(&quit_restart_lock);
@@ -3624,7 +4198,9 @@ static void tidyup(__maybe_unused void *arg)
 		ipaccess = NULL;
 	}
 
-	io_free();
+	for (int i = 0; i < API_MAX_CLIENTS; ++i)
+		if (api_clients[i])
+			api_client_close(i);
 
 	mutex_unlock(&quit_restart_lock);
 }
@@ -4095,32 +4671,377 @@ void mcast_init()
 		quit(1, "API mcast thread create failed");
 }
 
-void api(int api_thr_id)
+// Hands queued events to the clients subscribed to them
+static
+void api_events_deliver(const time_t now)
 {
+	struct api_event *ev, *evs;
+	struct api_client *client;
 	struct io_data *io_data;
-	struct thr_info bye_thr;
-	char buf[TMPBUFSIZ];
+	int i;
+	
+	mutex_lock(&api_events_mutex);
+	evs = api_events;
+	api_events = NULL;
+	api_events_tail = &api_events;
+	mutex_unlock(&api_events_mutex);
+	
+	while ((ev = evs))
+	{
+		evs = ev->next;
+		for (i = 0; i < API_MAX_CLIENTS; ++i)
+		{
+			client = api_clients[i];
+			if (!(client && (client->io_data->subscriptions & ev->class)))
+				continue;
+			io_data = client->io_data;
+			if (ev->class == APIEV_DEVICES)
+			{
+				// Rate limited clients would miss changes in between, so they only get full lists
+				if (io_data->devices_interval || io_data->devices_need_full)
+				{
+					if (!ev->full)
+						continue;
+					if (now - io_data->last_devices_event < io_data->devices_interval)
+						continue;
+				}
+				io_data->last_devices_event = now;
+				io_data->devices_need_full = false;
+			}
+			if (bytes_len(&io_data->data) > API_CLIENT_MAX_BACKLOG)
+			{
+				applog(LOG_WARNING, "API: subscriber %s is not keeping up, disconnecting", client->connectaddr);
+				api_client_close(i);
+				continue;
+			}
+			// Null-terminated, like replies
+			bytes_append(&io_data->data, ev->msg, strlen(ev->msg) + 1);
+		}
+		free(ev->msg);
+		free(ev);
+	}
+}
+
+/* Runs one request (a command, a "+"-joined list of commands, or a JSON
+ * request) received from a client, adding the reply to io_data */
+static
+void api_process_request(struct io_data * const io_data, char * const buf, const size_t buflen, const char group, const char * const connectaddr)
+{
+	const SOCKETTYPE c = io_data->sock;
 	char param_buf[TMPBUFSIZ];
-	SOCKETTYPE c;
-	int n, bound;
-	char *connectaddr;
-	const char *binderror;
-	struct timeval bindstart;
-	short int port = opt_api_port;
-	struct sockaddr_in serv;
-	struct sockaddr_in cli;
-	socklen_t clisiz;
 	char cmdbuf[100];
-	char *cmd = NULL, *cmdptr, *cmdsbuf;
+	char *cmd = NULL, *cmdptr, *cmdsbuf = NULL;
 	char *param;
-	bool addrok;
-	char group;
 	json_error_t json_err;
 	json_t *json_config = NULL;
 	json_t *json_val;
 	bool isjson;
 	bool did, isjoin, firstjoin;
 	int i;
+	
+	applog(LOG_DEBUG, "API: recv command: (%d) '%s'", (int)buflen, buf);
+	
+	// the time of the request in now
+	when = time(NULL);
+	io_data->close = false;
+	io_data->cbor = false;
+	firstjoin = isjoin = false;
+
+	did = false;
+
+	if (*buf != ISJSON) {
+		isjson = false;
+
+		param = strchr(buf, SEPARATOR);
+		if (param != NULL)
+			*(param++) = '\0';
+
+		cmd = buf;
+	}
+	else {
+		isjson = true;
+
+		param = NULL;
+
+#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
+		json_config = json_loadb(buf, buflen, 0, &json_err);
+#elif JANSSON_MAJOR_VERSION > 1
+		json_config = json_loads(buf, 0, &json_err);
+#else
+		json_config = json_loads(buf, &json_err);
+#endif
+
+		if (!json_is_object(json_config)) {
+			message(io_data, MSG_INVJSON, 0, NULL, isjson);
+			send_result(io_data, c, isjson);
+			did = true;
+		}
+		else {
+			json_val = json_object_get(json_config, JSON_COMMAND);
+			if (json_val == NULL) {
+				message(io_data, MSG_MISCMD, 0, NULL, isjson);
+				send_result(io_data, c, isjson);
+				did = true;
+			}
+			else {
+				if (!json_is_string(json_val)) {
+					message(io_data, MSG_INVCMD, 0, NULL, isjson);
+					send_result(io_data, c, isjson);
+					did = true;
+				}
+				else {
+					cmd = (char *)json_string_value(json_val);
+					json_val = json_object_get(json_config, JSON_ENCODING);
+					if (json_is_string(json_val) && !strcasecmp(json_string_value(json_val), "cbor"))
+						io_data->cbor = true;
+					json_val = json_object_get(json_config, JSON_PARAMETER);
+					if (json_is_string(json_val))
+						param = (char *)json_string_value(json_val);
+					else if (json_is_integer(json_val)) {
+						sprintf(param_buf, "%d", (int)json_integer_value(json_val));
+						param = param_buf;
+					} else if (json_is_real(json_val)) {
+						sprintf(param_buf, "%f", (double)json_real_value(json_val));
+						param = param_buf;
+					}
+				}
+			}
+		}
+	}
+
+	if (!did) {
+		if (strchr(cmd, CMDJOIN)) {
+			firstjoin = isjoin = true;
+			// cmd + leading+tailing '|' + '\0'
+			cmdsbuf = malloc(strlen(cmd) + 3);
+			if (!cmdsbuf)
+				quithere(1, "OOM cmdsbuf");
+			strcpy(cmdsbuf, "|");
+			param = NULL;
+		}
+
+		cmdptr = cmd;
+		do {
+			did = false;
+			if (isjoin) {
+				cmd = strchr(cmdptr, CMDJOIN);
+				if (cmd)
+					*(cmd++) = '\0';
+				if (!*cmdptr)
+					goto inochi;
+			}
+
+			for (i = 0; cmds[i].name != NULL; i++) {
+				if (strcmp(cmdptr, cmds[i].name) == 0) {
+					sprintf(cmdbuf, "|%s|", cmdptr);
+					if (isjoin) {
+						if (strstr(cmdsbuf, cmdbuf)) {
+							did = true;
+							break;
+						}
+						strcat(cmdsbuf, cmdptr);
+						strcat(cmdsbuf, "|");
+						head_join(io_data, cmdptr, isjson, &firstjoin);
+						if (!cmds[i].joinable) {
+							message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+							did = true;
+							tail_join(io_data, isjson);
+							break;
+						}
+					}
+					if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
+					{
+						per_proc = !strncmp(cmds[i].name, "proc", 4);
+						(cmds[i].func)(io_data, c, param, isjson, group);
+					}
+					else {
+						message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+						applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
+					}
+
+					did = true;
+					if (!isjoin)
+						send_result(io_data, c, isjson);
+					else
+						tail_join(io_data, isjson);
+					break;
+				}
+			}
+
+			if (!did) {
+				if (isjoin)
+					head_join(io_data, cmdptr, isjson, &firstjoin);
+				message(io_data, MSG_INVCMD, 0, NULL, isjson);
+				if (isjoin)
+					tail_join(io_data, isjson);
+				else
+					send_result(io_data, c, isjson);
+			}
+inochi:
+			if (isjoin)
+				cmdptr = cmd;
+		} while (isjoin && cmdptr);
+	}
+
+	if (isjson)
+		json_decref(json_config);
+
+	if (isjoin)
+		send_result(io_data, c, isjson);
+	free(cmdsbuf);
+}
+
+static
+void api_client_accept(const SOCKETTYPE apisock)
+{
+	struct sockaddr_in cli;
+	socklen_t clisiz = sizeof(cli);
+	struct api_client *client;
+	char *connectaddr;
+	char group;
+	bool addrok;
+	SOCKETTYPE c;
+	int i;
+	
+	if (SOCKETFAIL(c = accept(apisock, (struct sockaddr *)(&cli), &clisiz)))
+	{
+		if (!(sock_blocks() || interrupted()))
+			applog(LOG_WARNING, "API: accept failed: %s", SOCKERRMSG);
+		return;
+	}
+	
+	addrok = check_connect(&cli, &connectaddr, &group);
+	applog(LOG_DEBUG, "API: connection from %s - %s",
+				connectaddr, addrok ? "Accepted" : "Ignored");
+	
+	for (i = 0; i < API_MAX_CLIENTS; ++i)
+		if (!api_clients[i])
+			break;
+#ifndef WIN32
+	if (c >= FD_SETSIZE)
+		i = API_MAX_CLIENTS;
+#endif
+	if (addrok && i == API_MAX_CLIENTS)
+	{
+		applog(LOG_WARNING, "API: too many connections, dropping %s", connectaddr);
+		addrok = false;
+	}
+	if (!addrok)
+	{
+		shutdown(c, SHUT_RDWR);
+		CLOSESOCKET(c);
+		return;
+	}
+	
+	set_nonblocking(c, true);
+	
+	client = malloc(sizeof(*client));
+	if (unlikely(!client))
+		quithere(1, "Failed to malloc client");
+	*client = (struct api_client){
+		.io_data = sock_io_new(),
+		.group = group,
+		.last_active = time(NULL),
+	};
+	client->io_data->sock = c;
+	snprintf(client->connectaddr, sizeof(client->connectaddr), "%s", connectaddr);
+	api_clients[i] = client;
+}
+
+// Processes every complete request the client has sent so far
+static
+void api_client_process(struct api_client * const client, const bool eof)
+{
+	char *p, *nl;
+	
+	if (!opt_api_keepalive)
+	{
+		// One request per connection, as much of it as the first read got
+		client->buf[client->buflen] = '\0';
+		api_process_request(client->io_data, client->buf, client->buflen, client->group, client->connectaddr);
+		client->buflen = 0;
+		client->done = true;
+		return;
+	}
+	
+	// Keep-alive: newline-delimited requests, each answered with a null-terminated reply
+	client->buf[client->buflen] = '\0';
+	p = client->buf;
+	while ((nl = strchr(p, '\n')))
+	{
+		*nl = '\0';
+		if (nl > p && nl[-1] == '\r')
+			nl[-1] = '\0';
+		if (*p)
+			api_process_request(client->io_data, p, strlen(p), client->group, client->connectaddr);
+		p = &nl[1];
+	}
+	client->buflen -= (p - client->buf);
+	memmove(client->buf, p, client->buflen);
+	
+	if (eof || client->buflen >= sizeof(client->buf) - 1)
+	{
+		// Unterminated final request (or too long to ever be terminated)
+		client->buf[client->buflen] = '\0';
+		if (client->buflen)
+			api_process_request(client->io_data, client->buf, client->buflen, client->group, client->connectaddr);
+		client->buflen = 0;
+		client->done = true;
+	}
+}
+
+// Returns false if the client is to be disconnected
+static
+bool api_client_read(struct api_client * const client)
+{
+	struct io_data * const io_data = client->io_data;
+	const ssize_t n = recv(io_data->sock, &client->buf[client->buflen], sizeof(client->buf) - 1 - client->buflen, 0);
+	
+	if (SOCKETFAIL(n))
+	{
+		if (sock_blocks() || interrupted())
+			return true;
+		applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
+		return false;
+	}
+	if (!n)
+	{
+		// Client is done sending
+		if (io_data->subscriptions)
+			return false;
+		if (client->buflen)
+			api_client_process(client, true);
+		client->done = true;
+		return bytes_len(&io_data->data);
+	}
+	client->buflen += n;
+	client->last_active = time(NULL);
+	if (bytes_len(&io_data->data) > API_CLIENT_MAX_BACKLOG)
+	{
+		// Still sending requests, but not reading the replies
+		applog(LOG_WARNING, "API: client %s is not reading replies, disconnecting", client->connectaddr);
+		return false;
+	}
+	api_client_process(client, false);
+	return true;
+}
+
+void api(int api_thr_id)
+{
+	struct thr_info bye_thr;
+	int n, bound;
+	const char *binderror;
+	struct timeval bindstart;
+	short int port = opt_api_port;
+	struct sockaddr_in serv;
+	struct api_client *client;
+	struct io_data *io_data;
+	fd_set rfds, wfds;
+	struct timeval tv;
+	SOCKETTYPE maxfd;
+	time_t now;
+	int subscriptions;
+	int i;
 
 	SOCKETTYPE *apisock;
 
@@ -4132,9 +5053,6 @@ void api(int api_thr_id)
 	apisock = malloc(sizeof(*apisock));
 	*apisock = INVSOCK;
 
-	rpc_io_data =
-	io_data = sock_io_new();
-
 	mutex_init(&quit_restart_lock);
 
 	pthread_cleanup_push(tidyup, (void *)apisock);
@@ -4223,180 +5141,90 @@ void api(int api_thr_id)
 	if (opt_api_mcast)
 		mcast_init();
 
+	set_nonblocking(*apisock, true);
+	notifier_init(api_events_notifier);
+
+	// Serve all clients from this thread, without letting any of them block the others
 	while (!bye) {
-		clisiz = sizeof(cli);
-		if (SOCKETFAIL(c = accept(*apisock, (struct sockaddr *)(&cli), &clisiz))) {
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_SET(*apisock, &rfds);
+		maxfd = *apisock;
+		FD_SET(api_events_notifier[0], &rfds);
+		if (api_events_notifier[0] > maxfd)
+			maxfd = api_events_notifier[0];
+		subscriptions = 0;
+		now = time(NULL);
+		for (i = 0; i < API_MAX_CLIENTS; ++i)
+		{
+			client = api_clients[i];
+			if (!client)
+				continue;
+			io_data = client->io_data;
+			subscriptions |= io_data->subscriptions;
+			if ((io_data->subscriptions & APIEV_DEVICES) && (io_data->devices_need_full || (io_data->devices_interval && now - io_data->last_devices_event >= io_data->devices_interval)))
+				api_devices_want_full = true;
+			if (!client->done || io_data->subscriptions)
+				FD_SET(io_data->sock, &rfds);
+			if (bytes_len(&io_data->data))
+				FD_SET(io_data->sock, &wfds);
+			if (io_data->sock > maxfd)
+				maxfd = io_data->sock;
+		}
+		api_subscribed_events = subscriptions;
+		
+		tv = (struct timeval){ .tv_sec = 1, };
+		n = select(maxfd + 1, &rfds, &wfds, NULL, &tv);
+		if (SOCKETFAIL(n))
+		{
+			if (interrupted())
+				continue;
 			applog(LOG_ERR, "API failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
 			goto die;
 		}
-
-		addrok = check_connect(&cli, &connectaddr, &group);
-		applog(LOG_DEBUG, "API: connection from %s - %s",
-					connectaddr, addrok ? "Accepted" : "Ignored");
-
-		if (addrok) {
-			n = recv(c, &buf[0], TMPBUFSIZ-1, 0);
-			if (SOCKETFAIL(n))
-				buf[0] = '\0';
-			else
-				buf[n] = '\0';
-
-			if (opt_debug) {
-				if (SOCKETFAIL(n))
-					applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
-				else
-					applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, buf);
+		
+		now = time(NULL);
+		if (FD_ISSET(api_events_notifier[0], &rfds))
+		{
+			notifier_read(api_events_notifier);
+			api_events_deliver(now);
+		}
+		
+		for (i = 0; i < API_MAX_CLIENTS; ++i)
+		{
+			client = api_clients[i];
+			if (!client)
+				continue;
+			io_data = client->io_data;
+			if (FD_ISSET(io_data->sock, &wfds))
+			{
+				io_flush(io_data, false);
+				client->last_active = now;
 			}
-
-			firstjoin = isjoin = false;
-			if (!SOCKETFAIL(n)) {
-				// the time of the request in now
-				when = time(NULL);
-				io_reinit(io_data);
-				io_data->sock = c;
-
-				did = false;
-
-				if (*buf != ISJSON) {
-					isjson = false;
-
-					param = strchr(buf, SEPARATOR);
-					if (param != NULL)
-						*(param++) = '\0';
-
-					cmd = buf;
-				}
-				else {
-					isjson = true;
-
-					param = NULL;
-
-#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
-					json_config = json_loadb(buf, n, 0, &json_err);
-#elif JANSSON_MAJOR_VERSION > 1
-					json_config = json_loads(buf, 0, &json_err);
-#else
-					json_config = json_loads(buf, &json_err);
-#endif
-
-					if (!json_is_object(json_config)) {
-						message(io_data, MSG_INVJSON, 0, NULL, isjson);
-						send_result(io_data, c, isjson);
-						did = true;
-					}
-					else {
-						json_val = json_object_get(json_config, JSON_COMMAND);
-						if (json_val == NULL) {
-							message(io_data, MSG_MISCMD, 0, NULL, isjson);
-							send_result(io_data, c, isjson);
-							did = true;
-						}
-						else {
-							if (!json_is_string(json_val)) {
-								message(io_data, MSG_INVCMD, 0, NULL, isjson);
-								send_result(io_data, c, isjson);
-								did = true;
-							}
-							else {
-								cmd = (char *)json_string_value(json_val);
-								json_val = json_object_get(json_config, JSON_PARAMETER);
-								if (json_is_string(json_val))
-									param = (char *)json_string_value(json_val);
-								else if (json_is_integer(json_val)) {
-									sprintf(param_buf, "%d", (int)json_integer_value(json_val));
-									param = param_buf;
-								} else if (json_is_real(json_val)) {
-									sprintf(param_buf, "%f", (double)json_real_value(json_val));
-									param = param_buf;
-								}
-							}
-						}
-					}
-				}
-
-				if (!did) {
-					if (strchr(cmd, CMDJOIN)) {
-						firstjoin = isjoin = true;
-						// cmd + leading+tailing '|' + '\0'
-						cmdsbuf = malloc(strlen(cmd) + 3);
-						if (!cmdsbuf)
-							quithere(1, "OOM cmdsbuf");
-						strcpy(cmdsbuf, "|");
-						param = NULL;
-					}
-
-					cmdptr = cmd;
-					do {
-						did = false;
-						if (isjoin) {
-							cmd = strchr(cmdptr, CMDJOIN);
-							if (cmd)
-								*(cmd++) = '\0';
-							if (!*cmdptr)
-								goto inochi;
-						}
-
-						for (i = 0; cmds[i].name != NULL; i++) {
-							if (strcmp(cmdptr, cmds[i].name) == 0) {
-								sprintf(cmdbuf, "|%s|", cmdptr);
-								if (isjoin) {
-									if (strstr(cmdsbuf, cmdbuf)) {
-										did = true;
-										break;
-									}
-									strcat(cmdsbuf, cmdptr);
-									strcat(cmdsbuf, "|");
-									head_join(io_data, cmdptr, isjson, &firstjoin);
-									if (!cmds[i].joinable) {
-										message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-										did = true;
-										tail_join(io_data, isjson);
-										break;
-									}
-								}
-								if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
-								{
-									per_proc = !strncmp(cmds[i].name, "proc", 4);
-									(cmds[i].func)(io_data, c, param, isjson, group);
-								}
-								else {
-									message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-									applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
-								}
-
-								did = true;
-								if (!isjoin)
-									send_result(io_data, c, isjson);
-								else
-									tail_join(io_data, isjson);
-								break;
-							}
-						}
-
-						if (!did) {
-							if (isjoin)
-								head_join(io_data, cmdptr, isjson, &firstjoin);
-							message(io_data, MSG_INVCMD, 0, NULL, isjson);
-							if (isjoin)
-								tail_join(io_data, isjson);
-							else
-								send_result(io_data, c, isjson);
-						}
-inochi:
-						if (isjoin)
-							cmdptr = cmd;
-					} while (isjoin && cmdptr);
+			if (FD_ISSET(io_data->sock, &rfds) && !api_client_read(client))
+			{
+				api_client_close(i);
+				continue;
+			}
+			if (bytes_len(&io_data->data))
+			{
+				if (now - client->last_active > API_CLIENT_TIMEOUT)
+				{
+					applog(LOG_WARNING, "RPC: Timed out with %ld bytes left to send",
+					       (long)bytes_len(&io_data->data));
+					api_client_close(i);
 				}
-
-				if (isjson)
-					json_decref(json_config);
-
-				if (isjoin)
-					send_result(io_data, c, isjson);
 			}
+			else
+			if (io_data->subscriptions)
+				{}  // Stays open until the client disconnects
+			else
+			if (client->done || now - client->last_active > API_CLIENT_TIMEOUT)
+				api_client_close(i);
 		}
-		shutdown(c, SHUT_RDWR);
-		CLOSESOCKET(c);
+		
+		if (FD_ISSET(*apisock, &rfds))
+			api_client_accept(*apisock);
 	}
 die:
 	/* Blank line fix for older compilers since pthread_cleanup_pop is a
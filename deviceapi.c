@@ -19,8 +19,12 @@
 #else
 #include <sys/select.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
@@ -38,6 +42,9 @@
 #include "miner.h"
 #include "util.h"
 
+// Most works minerloop_queue fetches at once for a queue_space driver
+#define QUEUE_BATCH_MAX  0x100
+
 struct driver_registration *_bfg_drvreg1;
 struct driver_registration *_bfg_drvreg2;
 
@@ -235,6 +242,291 @@ struct work *get_and_prepare_work(struct thr_info *thr)
 	return work;
 }
 
+// Like get_and_prepare_work, but gets up to max works with a single trip to the staged queue
+static
+int get_and_prepare_works(struct thr_info * const thr, struct work ** const works, const int max)
+{
+	struct cgpu_info *proc = thr->cgpu;
+	struct device_drv *api = proc->drv;
+	const int count = get_work_batch(thr, works, max);
+	
+	if (api->prepare_work)
+		for (int i = 0; i < count; ++i)
+			if (!api->prepare_work(thr, works[i]))
+			{
+				for (int j = i; j < count; ++j)
+					free_work(works[j]);
+				applog(LOG_ERR, "%"PRIpreprv": Work prepare failed, disabling!", proc->proc_repr);
+				proc->deven = DEV_RECOVER_ERR;
+				run_cmd(cmd_idle);
+				return i;
+			}
+	return count;
+}
+
+struct nonce_partition *nonce_partition_new(const int members)
+{
+	struct nonce_partition * const np = malloc(sizeof(*np));
+	*np = (struct nonce_partition){
+		.members = members,
+	};
+	mutex_init(&np->mutex);
+	if (unlikely(pthread_cond_init(&np->cond, NULL)))
+		quit(1, "Failed to pthread_cond_init in nonce_partition_new");
+	return np;
+}
+
+static
+void nonce_partition_unlock(void * const p)
+{
+	struct nonce_partition * const np = p;
+	mutex_unlock_noyield(&np->mutex);
+}
+
+// Must be called with np->mutex held
+static
+void nonce_partition_drop(struct nonce_partition * const np)
+{
+	if (!np->work)
+		return;
+	free_work(np->work);
+	np->work = NULL;
+	++np->generation;
+}
+
+// Must be called with np->mutex held
+static
+bool nonce_partition_roll_ntime(struct nonce_partition * const np)
+{
+	struct work * const work = np->work;
+	const struct ntime_roll_limits * const nrl = &work->ntime_roll_limits;
+	const uint32_t ntime = work_get_ntime(work) + 1;
+	
+	if (ntime > nrl->max)
+		return false;
+	// Don't get further ahead of the clock than the pool allows
+	if ((int64_t)ntime > (int64_t)np->base_ntime + timer_elapsed(&nrl->tv_ref, NULL) + nrl->maxoff)
+		return false;
+	
+	work_set_ntime(work, ntime);
+	np->next_nonce = 0;
+	// Threads must recopy the work, including any data prepared from the old ntime
+	++np->generation;
+	applog(LOG_DEBUG, "Rolled shared work %d ntime to %08lx", work->id, (unsigned long)ntime);
+	return true;
+}
+
+static
+bool nonce_partition_prepare_work(struct thr_info * const mythr, struct work * const work)
+{
+	struct cgpu_info * const proc = mythr->cgpu;
+	struct device_drv * const api = proc->drv;
+	
+	if (!api->prepare_work || api->prepare_work(mythr, work))
+		return true;
+	free_work(work);
+	applog(LOG_ERR, "%"PRIpreprv": Work prepare failed, disabling!", proc->proc_repr);
+	proc->deven = DEV_RECOVER_ERR;
+	run_cmd(cmd_idle);
+	return false;
+}
+
+// Must be called with np->mutex held
+static
+void nonce_partition_set_work(struct nonce_partition * const np, struct work * const master)
+{
+	np->work = master;
+	np->next_nonce = 0;
+	np->base_ntime = work_get_ntime(master);
+	timer_set_now(&np->tv_work_start);
+	master->tv_work_start = np->tv_work_start;
+	++np->generation;
+}
+
+/* Assigns the next unscanned nonce range of the partition's work to the
+ * thread's private copy in *workp, getting new work only when the current one
+ * is exhausted (after local ntime rolling), stale, or out of scantime.
+ * New work for the same stratum/GBT job is generated locally when possible.
+ * If rangesz is zero (the driver cannot limit work), an even slice of the
+ * nonce space is assigned instead. */
+static
+bool nonce_partition_next(struct thr_info * const mythr, struct nonce_partition * const np, struct work ** const workp, unsigned * const generationp, uint64_t rangesz, uint32_t * const out_range_end)
+{
+	struct cgpu_info * const proc = mythr->cgpu;
+	struct work *master, *work = *workp;
+	
+	if (!rangesz)
+		rangesz = 0x100000000ULL / np->members;
+	if (rangesz > 0xffffffff)
+		rangesz = 0xffffffff;
+	
+	mutex_lock(&np->mutex);
+	while (true)
+	{
+		if (np->fetching)
+		{
+			thread_reportout(mythr);
+			pthread_cleanup_push(nonce_partition_unlock, np);
+			pthread_cond_wait(&np->cond, &np->mutex);
+			pthread_cleanup_pop(0);
+			thread_reportin(mythr);
+			continue;
+		}
+		
+		master = np->work;
+		if (master)
+		{
+			if (stale_work(master, false) || timer_elapsed(&np->tv_work_start, NULL) > opt_scantime)
+				nonce_partition_drop(np);
+			else
+			if (np->next_nonce <= 0xffffffff)
+				break;
+			else
+			if (nonce_partition_roll_ntime(np))
+			{
+				// Precalculated data (eg, OpenCL's) depends on ntime
+				if (!nonce_partition_prepare_work(mythr, master))
+				{
+					np->work = NULL;
+					++np->generation;
+					mutex_unlock(&np->mutex);
+					return false;
+				}
+				break;
+			}
+			else
+				nonce_partition_drop(np);
+		}
+		
+		if (unlikely(proc->shutdown))
+		{
+			mutex_unlock(&np->mutex);
+			return false;
+		}
+		
+		// Prefer making more work from the same job locally, without the pool's locks
+		master = local_work_gen_next(&np->gen);
+		if (master)
+		{
+			master->thr_id = mythr->id;
+			if (!nonce_partition_prepare_work(mythr, master))
+			{
+				mutex_unlock(&np->mutex);
+				return false;
+			}
+			nonce_partition_set_work(np, master);
+			continue;
+		}
+		
+		// Only one thread fetches new work; the others wait for it above
+		np->fetching = true;
+		mutex_unlock(&np->mutex);
+		request_work(mythr);
+		master = get_work(mythr);
+		if (master && !nonce_partition_prepare_work(mythr, master))
+			master = NULL;
+		if (master)
+			local_work_gen_init(&np->gen, master);
+		mutex_lock(&np->mutex);
+		np->fetching = false;
+		pthread_cond_broadcast(&np->cond);
+		if (!master)
+		{
+			mutex_unlock(&np->mutex);
+			return false;
+		}
+		nonce_partition_set_work(np, master);
+	}
+	
+	if (!(work && *generationp == np->generation))
+	{
+		if (work)
+			free_work(work);
+		*workp = work = copy_work(master);
+		*generationp = np->generation;
+	}
+	
+	if (rangesz > 0x100000000ULL - np->next_nonce)
+		rangesz = 0x100000000ULL - np->next_nonce;
+	work->blk.nonce = np->next_nonce;
+	*out_range_end = np->next_nonce + rangesz - 1;
+	np->next_nonce += rangesz;
+	mutex_unlock(&np->mutex);
+	
+	return true;
+}
+
+// Called when a thread is told to restart: forget the shared work, unless another thread already did
+static
+void nonce_partition_restart(struct nonce_partition * const np, const unsigned generation)
+{
+	mutex_lock(&np->mutex);
+	if (np->generation == generation)
+		nonce_partition_drop(np);
+	mutex_unlock(&np->mutex);
+}
+
+static
+bool nonce_range_done(const struct work * const work, const uint32_t range_start, const uint32_t range_end, const uint64_t max_hashes, const bool can_limit)
+{
+	const uint32_t scanned = work->blk.nonce - range_start;
+	const uint32_t rangesz = range_end - range_start + 1;
+	
+	// Drivers which cannot limit work are assumed to overshoot by up to max_hashes (see abandon_work)
+	if (!can_limit)
+		return (rangesz <= max_hashes || scanned >= rangesz - max_hashes);
+	return (work->blk.nonce == (uint32_t)(range_end + 1) || scanned >= rangesz);
+}
+
+static
+void minerloop_scanhash_partitioned(struct thr_info * const mythr, struct nonce_partition * const np)
+{
+	struct cgpu_info *cgpu = mythr->cgpu;
+	struct device_drv *api = cgpu->drv;
+	struct timeval tv_start, tv_end, tv_hashes;
+	const bool can_limit = api->can_limit_work;
+	uint32_t max_nonce = can_limit ? api->can_limit_work(mythr) : 0xffffffff;
+	uint32_t range_start, range_end;
+	unsigned generation = 0;
+	int64_t hashes;
+	struct work *work = NULL;
+	
+	while (likely(!cgpu->shutdown)) {
+		mythr->work_restart = false;
+		if (!nonce_partition_next(mythr, np, &work, &generation, can_limit ? ((uint64_t)max_nonce + 1) : 0, &range_end))
+			break;
+		range_start = work->blk.nonce;
+		
+		do {
+			thread_reportin(mythr);
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			timer_set_now(&tv_start);
+			
+			hashes = api->scanhash(mythr, work, range_end);
+			
+			timer_set_now(&tv_end);
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+			pthread_testcancel();
+			thread_reportin(mythr);
+			
+			timersub(&tv_end, &tv_start, &tv_hashes);
+			if (!hashes_done(mythr, hashes, &tv_hashes, can_limit ? &max_nonce : NULL))
+				goto disabled;
+			
+			if (unlikely(mythr->work_restart)) {
+				nonce_partition_restart(np, generation);
+				break;
+			}
+			
+			if (unlikely(mythr->pause || cgpu->deven != DEV_ENABLED))
+disabled:
+				mt_disable(mythr);
+		} while (!nonce_range_done(work, range_start, range_end, cgpu->max_hashes, can_limit));
+	}
+	if (work)
+		free_work(work);
+}
+
 // Miner loop to manage a single processor (with possibly multiple threads per processor)
 void minerloop_scanhash(struct thr_info *mythr)
 {
@@ -254,6 +546,12 @@ void minerloop_scanhash(struct thr_info *mythr)
 	if (cgpu->deven != DEV_ENABLED)
 		mt_disable(mythr);
 	
+	if (cgpu->nonce_partition)
+	{
+		minerloop_scanhash_partitioned(mythr, cgpu->nonce_partition);
+		return;
+	}
+	
 	while (likely(!cgpu->shutdown)) {
 		mythr->work_restart = false;
 		request_work(mythr);
@@ -475,41 +773,139 @@ bool do_process_results(struct thr_info *mythr, struct timeval *tvp_now, struct
 	return true;
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+// Keeps a persistent epoll set for the thread's notifiers, rebuilding it only if they change
+static
+bool notifier_epoll_prepare(struct thr_info * const thr)
+{
+	const SOCKETTYPE fds[] = {
+		thr->notifier[0],
+		thr->work_restart_notifier[0],
+		(thr->mutex_request[1] != INVSOCK) ? thr->mutex_request[0] : INVSOCK,
+	};
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+	};
+	
+	if (thr->_notifier_epoll_failed)
+		return false;
+	if (thr->_notifier_epoll_ready && !memcmp(fds, thr->_notifier_epoll_fds, sizeof(fds)))
+		return true;
+	
+	if (thr->_notifier_epoll_ready)
+	{
+		close(thr->_notifier_epollfd);
+		thr->_notifier_epoll_ready = false;
+	}
+	thr->_notifier_epollfd = epoll_create(sizeof(fds) / sizeof(*fds));
+	if (thr->_notifier_epollfd == -1)
+	{
+		thr->_notifier_epoll_failed = true;
+		return false;
+	}
+	for (int i = 0; i < sizeof(fds) / sizeof(*fds); ++i)
+	{
+		if (fds[i] == INVSOCK)
+			continue;
+		ev.data.fd = fds[i];
+		if (epoll_ctl(thr->_notifier_epollfd, EPOLL_CTL_ADD, fds[i], &ev))
+		{
+			close(thr->_notifier_epollfd);
+			thr->_notifier_epoll_failed = true;
+			applogr(false, LOG_DEBUG, "%"PRIpreprv": Failed to add notifier to epoll set, falling back to select", thr->cgpu->proc_repr);
+		}
+	}
+	memcpy(thr->_notifier_epoll_fds, fds, sizeof(fds));
+	thr->_notifier_epoll_ready = true;
+	return true;
+}
+
+static
+void notifier_epoll_destroy(struct thr_info * const thr)
+{
+	if (thr->_notifier_epoll_ready)
+	{
+		close(thr->_notifier_epollfd);
+		thr->_notifier_epoll_ready = false;
+	}
+}
+#endif
+
+// Lets each requester waiting in cgpu_request_control take control in turn
+static
+void cgpu_grant_control(struct cgpu_info * const cgpu)
+{
+	pthread_mutex_t * const mutexp = &cgpu->device_mutex;
+	
+	mutex_lock(mutexp);
+	while (cgpu->control_requests)
+	{
+		cgpu->control_granted = true;
+		pthread_cond_broadcast(&cgpu->device_cond);
+		// The requester claims the grant, and holds the mutex until it releases control
+		while (cgpu->control_granted)
+			pthread_cond_wait(&cgpu->device_cond, mutexp);
+	}
+	mutex_unlock(mutexp);
+}
+
 static
 void do_notifier_select(struct thr_info *thr, struct timeval *tvp_timeout)
 {
 	struct cgpu_info *cgpu = thr->cgpu;
-	struct timeval tv_now;
-	int maxfd;
-	fd_set rfds;
+	struct timeval tv_now, *tvp;
+	bool notified = false, restarted = false, requested = false;
 	
 	timer_set_now(&tv_now);
-	FD_ZERO(&rfds);
-	FD_SET(thr->notifier[0], &rfds);
-	maxfd = thr->notifier[0];
-	FD_SET(thr->work_restart_notifier[0], &rfds);
-	set_maxfd(&maxfd, thr->work_restart_notifier[0]);
-	if (thr->mutex_request[1] != INVSOCK)
+	tvp = select_timeout(tvp_timeout, &tv_now);
+#ifdef HAVE_SYS_EPOLL_H
+	if (notifier_epoll_prepare(thr))
 	{
-		FD_SET(thr->mutex_request[0], &rfds);
-		set_maxfd(&maxfd, thr->mutex_request[0]);
+		struct epoll_event evr[3];
+		const int timeout_ms = tvp ? ((tvp->tv_sec * 1000) + ((tvp->tv_usec + 999) / 1000)) : -1;
+		const int n = epoll_wait(thr->_notifier_epollfd, evr, sizeof(evr) / sizeof(*evr), timeout_ms);
+		if (n < 0)
+			return;
+		for (int i = 0; i < n; ++i)
+		{
+			if (evr[i].data.fd == thr->_notifier_epoll_fds[0])
+				notified = true;
+			if (evr[i].data.fd == thr->_notifier_epoll_fds[1])
+				restarted = true;
+			if (evr[i].data.fd == thr->_notifier_epoll_fds[2])
+				requested = true;
+		}
 	}
-	if (select(maxfd + 1, &rfds, NULL, NULL, select_timeout(tvp_timeout, &tv_now)) < 0)
-		return;
-	if (thr->mutex_request[1] != INVSOCK && FD_ISSET(thr->mutex_request[0], &rfds))
+	else
+#endif
+	{
+		int maxfd;
+		fd_set rfds;
+		
+		FD_ZERO(&rfds);
+		FD_SET(thr->notifier[0], &rfds);
+		maxfd = thr->notifier[0];
+		FD_SET(thr->work_restart_notifier[0], &rfds);
+		set_maxfd(&maxfd, thr->work_restart_notifier[0]);
+		if (thr->mutex_request[1] != INVSOCK)
+		{
+			FD_SET(thr->mutex_request[0], &rfds);
+			set_maxfd(&maxfd, thr->mutex_request[0]);
+		}
+		if (select(maxfd + 1, &rfds, NULL, NULL, tvp) < 0)
+			return;
+		notified = FD_ISSET(thr->notifier[0], &rfds);
+		restarted = FD_ISSET(thr->work_restart_notifier[0], &rfds);
+		requested = (thr->mutex_request[1] != INVSOCK && FD_ISSET(thr->mutex_request[0], &rfds));
+	}
+	if (requested)
 	{
-		// FIXME: This can only handle one request at a time!
-		pthread_mutex_t *mutexp = &cgpu->device_mutex;
 		notifier_read(thr->mutex_request);
-		mutex_lock(mutexp);
-		pthread_cond_signal(&cgpu->device_cond);
-		pthread_cond_wait(&cgpu->device_cond, mutexp);
-		mutex_unlock(mutexp);
+		cgpu_grant_control(cgpu);
 	}
-	if (FD_ISSET(thr->notifier[0], &rfds)) {
+	if (notified)
 		notifier_read(thr->notifier);
-	}
-	if (FD_ISSET(thr->work_restart_notifier[0], &rfds))
+	if (restarted)
 		notifier_read(thr->work_restart_notifier);
 }
 
@@ -526,8 +922,13 @@ void cgpu_request_control(struct cgpu_info * const cgpu)
 	if (pthread_equal(pthread_self(), thr->pth))
 		return;
 	mutex_lock(&cgpu->device_mutex);
+	++cgpu->control_requests;
 	notifier_wake(thr->mutex_request);
-	pthread_cond_wait(&cgpu->device_cond, &cgpu->device_mutex);
+	while (!cgpu->control_granted)
+		pthread_cond_wait(&cgpu->device_cond, &cgpu->device_mutex);
+	// Claim the grant; the device mutex stays held until cgpu_release_control
+	cgpu->control_granted = false;
+	--cgpu->control_requests;
 }
 
 void cgpu_release_control(struct cgpu_info * const cgpu)
@@ -535,7 +936,7 @@ void cgpu_release_control(struct cgpu_info * const cgpu)
 	struct thr_info * const thr = cgpu->thr[0];
 	if (pthread_equal(pthread_self(), thr->pth))
 		return;
-	pthread_cond_signal(&cgpu->device_cond);
+	pthread_cond_broadcast(&cgpu->device_cond);
 	mutex_unlock(&cgpu->device_mutex);
 }
 
@@ -649,12 +1050,19 @@ void do_queue_flush(struct thr_info *mythr)
 	struct cgpu_info *proc = mythr->cgpu;
 	struct device_drv *api = proc->drv;
 	
+	struct work *work, *tmp;
+	
 	api->queue_flush(mythr);
 	if (mythr->next_work)
 	{
 		free_work(mythr->next_work);
 		mythr->next_work = NULL;
 	}
+	DL_FOREACH_SAFE(mythr->_queue_pending, work, tmp)
+	{
+		DL_DELETE(mythr->_queue_pending, work);
+		free_work(work);
+	}
 }
 
 void minerloop_queue(struct thr_info *thr)
@@ -666,7 +1074,8 @@ void minerloop_queue(struct thr_info *thr)
 	struct timeval tv_timeout;
 	struct cgpu_info *proc;
 	bool should_be_running;
-	struct work *work;
+	struct work *work, *works[QUEUE_BATCH_MAX];
+	int space, count;
 	
 	_minerloop_setup(thr);
 	
@@ -698,10 +1107,28 @@ redo:
 						mythr->next_work = NULL;
 					}
 					else
+					if (mythr->_queue_pending)
+					{
+						work = mythr->_queue_pending;
+						DL_DELETE(mythr->_queue_pending, work);
+					}
+					else
 					{
 						request_work(mythr);
-						// FIXME: Allow get_work to return NULL to retry on notification
-						work = get_and_prepare_work(mythr);
+						space = api->queue_space ? api->queue_space(mythr) : 1;
+						if (space > 1)
+						{
+							// Fetch everything the device has room for at once
+							if (space > QUEUE_BATCH_MAX)
+								space = QUEUE_BATCH_MAX;
+							count = get_and_prepare_works(mythr, works, space);
+							for (int i = 1; i < count; ++i)
+								DL_APPEND(mythr->_queue_pending, works[i]);
+							work = count ? works[0] : NULL;
+						}
+						else
+							// FIXME: Allow get_work to return NULL to retry on notification
+							work = get_and_prepare_work(mythr);
 					}
 					if (!work)
 						break;
@@ -789,6 +1216,9 @@ out: ;
 	if (drv->thread_shutdown)
 		drv->thread_shutdown(mythr);
 
+#ifdef HAVE_SYS_EPOLL_H
+	notifier_epoll_destroy(mythr);
+#endif
 	notifier_destroy(mythr->notifier);
 
 	return NULL;
@@ -43,6 +43,7 @@ extern float common_scrypt_min_nonce_diff(struct cgpu_info *, const struct minin
 
 extern void request_work(struct thr_info *);
 extern struct work *get_work(struct thr_info *);
+extern int get_work_batch(struct thr_info *, struct work **works, int max);
 extern bool hashes_done(struct thr_info *, int64_t hashes, struct timeval *tvp_hashes, uint32_t *max_nonce);
 extern bool hashes_done2(struct thr_info *, int64_t hashes, uint32_t *max_nonce);
 extern void mt_disable_start(struct thr_info *);
@@ -50,6 +51,22 @@ extern void mt_disable_finish(struct thr_info *);
 extern void mt_disable(struct thr_info *);  // blocks until reenabled
 
 extern int restart_wait(struct thr_info *, unsigned int ms);
+
+// Splits one work item into disjoint nonce ranges for every thread sharing it (see minerloop_scanhash)
+struct nonce_partition {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool fetching;
+	
+	struct work *work;
+	unsigned generation;
+	uint64_t next_nonce;
+	uint32_t base_ntime;
+	struct timeval tv_work_start;
+	int members;
+	struct local_work_gen gen;
+};
+extern struct nonce_partition *nonce_partition_new(int members);
 extern void minerloop_scanhash(struct thr_info *);
 
 extern void mt_disable_start__async(struct thr_info *);
@@ -72,6 +72,7 @@ int bfsb_autodetect()
 			
 			port = malloc(sizeof(*port));
 			*port = *sys_spi;
+			port->fd = -1;
 			port->cgpu = &dummy_cgpu;
 			port->txrx = bfsb_spi_txrx;
 			port->speed = 625000;
@@ -108,7 +109,10 @@ int bfsb_autodetect()
 				prev_cgpu = cgpu;
 			}
 			else
+			{
+				spi_close(port);
 				free(port);
+			}
 	}
 	
 	if (proc1)
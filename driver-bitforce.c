@@ -135,6 +135,7 @@ bool bitforce_vcom_open(struct cgpu_info * const dev)
 	struct bitforce_data * const devdata = dev->device_data;
 	const char * const devpath = dev->device_path;
 	dev->device_fd = serial_open(devpath, 0, BITFORCE_VCOM_TIMEOUT_DSEC, true);
+	bytes_reset(&devdata->getsbuf);
 	devdata->is_open = (dev->device_fd != -1);
 	return devdata->is_open;
 }
@@ -147,40 +148,25 @@ void bitforce_vcom_close(struct cgpu_info * const dev)
 	{
 		serial_close(dev->device_fd);
 		dev->device_fd = -1;
+		bytes_free(&devdata->getsbuf);
 		devdata->is_open = false;
 	}
 }
 
+// NOTE: getsbuf holds data read ahead by gets, so reads must go through it too
 static
-ssize_t bitforce_vcom_read(void * const buf_p, size_t bufLen, struct cgpu_info * const dev)
+ssize_t bitforce_vcom_read(void * const buf, size_t bufLen, struct cgpu_info * const dev)
 {
-	uint8_t *buf = buf_p;
-	const int fd = dev->device_fd;
-	ssize_t rv, ret = 0;
-	while (bufLen > 0)
-	{
-		rv = read(fd, buf, bufLen);
-		if (rv <= 0)
-		{
-			if (ret > 0)
-				return ret;
-			return rv;
-		}
-		buf += rv;
-		bufLen -= rv;
-		ret += rv;
-	}
-	return ret;
+	struct bitforce_data * const devdata = dev->device_data;
+	return serial_read_buffered(dev->device_fd, &devdata->getsbuf, buf, bufLen);
 }
 
 static
 void bitforce_vcom_gets(char *buf, size_t bufLen, struct cgpu_info * const dev)
 {
-	const int fd = dev->device_fd;
-	while (likely(bufLen > 1 && read(fd, buf, 1) == 1 && (buf++)[0] != '\n'))
-	{}
-
-	buf[0] = '\0';
+	struct bitforce_data * const devdata = dev->device_data;
+	const ssize_t len = serial_read_line_buffered(dev->device_fd, &devdata->getsbuf, buf, bufLen - 1, '\n');
+	buf[(len > 0) ? len : 0] = '\0';
 }
 
 static
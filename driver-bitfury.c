@@ -190,6 +190,7 @@ bool bitfury_init_chip(struct cgpu_info * const proc)
 		.nbits = htole32(0x6461011a),
 	};
 	bitfury_payload_to_atrvec(bitfury->atrvec, &payload);
+	bitfury_atrvec_changed(bitfury);
 	return bitfury_init_oldbuf(proc, NULL);
 }
 
@@ -266,31 +267,30 @@ bool bitfury_job_prepare(struct thr_info *thr, struct work *work, __maybe_unused
 	}
 	work_to_bitfury_payload(&bitfury->payload, work);
 	if (bitfury->chipgen)
+	{
 		bitfury_payload_to_atrvec(bitfury->atrvec, &bitfury->payload);
+		bitfury_atrvec_changed(bitfury);
+	}
 	
 	work->blk.nonce = 0xffffffff;
 	return true;
 }
 
+// Checks candidate nonces against work using state, which is prepared the first time it is used for that work
 static
-bool fudge_nonce(struct work * const work, uint32_t *nonce_p) {
-	static const uint32_t offsets[] = {0, 0xffc00000, 0xff800000, 0x02800000, 0x02C00000, 0x00400000};
-	uint32_t nonce;
-	int i;
-	
+bool fudge_nonce(struct work * const work, struct bitfury_rehash_state * const state, const struct work ** const state_work_p, uint32_t *nonce_p) {
 	if (unlikely(!work))
 		return false;
 	
-	for (i = 0; i < 6; ++i)
+	if (*state_work_p != work)
 	{
-		nonce = *nonce_p + offsets[i];
-		if (test_nonce(work, nonce, false))
-		{
-			*nonce_p = nonce;
-			return true;
-		}
+		const uint32_t m7    = *((uint32_t *)&work->data[64]);
+		const uint32_t ntime = *((uint32_t *)&work->data[68]);
+		const uint32_t nbits = *((uint32_t *)&work->data[72]);
+		bitfury_rehash_prepare(state, work->midstate, m7, ntime, nbits);
+		*state_work_p = work;
 	}
-	return false;
+	return bitfury_fudge_nonce_prepared(state, nonce_p);
 }
 
 void bitfury_noop_job_start(struct thr_info __maybe_unused * const thr)
@@ -414,7 +414,9 @@ void bitfury_do_io(struct thr_info * const master_thr)
 			procs[n_chips] = proc;
 			spi_emit_fasync(spi, bitfury->fasync - lastchip);
 			lastchip = bitfury->fasync;
-			rxbuf[n_chips] = spi_emit_data(spi, 0x3000, &bitfury->atrvec[0], 19 * 4);
+			if (unlikely(!bitfury->atrvec_frame[0]))
+				spi_format_data(bitfury->atrvec_frame, 0x3000, &bitfury->atrvec[0], 19 * 4);
+			rxbuf[n_chips] = spi_emit_formatted_data(spi, bitfury->atrvec_frame, sizeof(bitfury->atrvec_frame));
 			++n_chips;
 		}
 		else
@@ -591,6 +593,9 @@ void bitfury_do_io(struct thr_info * const master_thr)
 		
 		if (n)
 		{
+			struct bitfury_rehash_state rehash_work, rehash_prev_work;
+			const struct work *rehash_work_p = NULL, *rehash_prev_work_p = NULL;
+			
 			for (i = 0; i < n; ++i)
 			{
 				nonce = bitfury_decnonce(newbuf[i]);
@@ -614,7 +619,7 @@ void bitfury_do_io(struct thr_info * const master_thr)
 						goto chipgen_detected;
 				}
 				else
-				if (fudge_nonce(thr->work, &nonce))
+				if (fudge_nonce(thr->work, &rehash_work, &rehash_work_p, &nonce))
 				{
 					applog(LOG_DEBUG, "%"PRIpreprv": nonce %x = %08lx (work=%p)",
 					       proc->proc_repr, i, (unsigned long)nonce, thr->work);
@@ -626,7 +631,7 @@ void bitfury_do_io(struct thr_info * const master_thr)
 					applog(LOG_DEBUG, "%"PRIpreprv": Ignoring unrecognised nonce %08lx (no prev work)",
 					       proc->proc_repr, (unsigned long)be32toh(nonce));
 				else
-				if (fudge_nonce(thr->prev_work, &nonce))
+				if (fudge_nonce(thr->prev_work, &rehash_prev_work, &rehash_prev_work_p, &nonce))
 				{
 					applog(LOG_DEBUG, "%"PRIpreprv": nonce %x = %08lx (prev work=%p)",
 					       proc->proc_repr, i, (unsigned long)nonce, thr->prev_work);
@@ -660,6 +665,7 @@ chipgen_detected:
 				applog(LOG_DEBUG, "%"PRIpreprv": Detected bitfury gen%d chip",
 				       proc->proc_repr, bitfury->chipgen);
 				bitfury_payload_to_atrvec(bitfury->atrvec, &bitfury->payload);
+				bitfury_atrvec_changed(bitfury);
 			}
 			bitfury->active = (bitfury->active + n) % 0x10;
 		}
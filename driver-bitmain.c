@@ -1543,6 +1543,17 @@ static bool bitmain_queue_append(struct thr_info * const thr, struct work * cons
 	return true;
 }
 
+static int bitmain_queue_space(struct thr_info * const thr)
+{
+	struct cgpu_info * const dev = thr->cgpu->device;
+	struct bitmain_info * const info = dev->device_data;
+	
+	// A pending restart clears the device queue before the next send
+	if (info->work_restart)
+		return info->max_fifo_space;
+	return info->fifo_space - info->ready_to_queue;
+}
+
 static void bitmain_queue_flush(struct thr_info * const thr)
 {
 	struct cgpu_info * const proc = thr->cgpu;
@@ -1864,6 +1875,7 @@ struct device_drv bitmain_drv = {
 	
 	.minerloop = minerloop_queue,
 	.queue_append = bitmain_queue_append,
+	.queue_space = bitmain_queue_space,
 	.queue_flush = bitmain_queue_flush,
 	.poll = bitmain_poll,
 	
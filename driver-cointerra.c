@@ -210,13 +210,11 @@ fail:
 
 static void cta_clear_work(struct cgpu_info *cgpu)
 {
-	struct work *work, *tmp;
+	struct cointerra_info *info = cgpu->device_data;
 
 	wr_lock(&cgpu->qlock);
-	HASH_ITER(hh, cgpu->queued_work, work, tmp) {
-		__work_completed(cgpu, work);
-		free_work(work);
-	}
+	work_id_table_clear(&info->work_table);
+	cgpu->queued_count = 0;
 	wr_unlock(&cgpu->qlock);
 }
 
@@ -338,41 +336,33 @@ bool cointerra_lowl_match(const struct lowlevel_device_info * const info)
 	return lowlevel_match_lowlproduct(info, &lowl_usb, "GoldStrike");
 }
 
-/* This function will remove a work item from the hashtable if it matches the
- * id in work->subid and return a pointer to the work but it will not free the
+/* This function will remove a work item from the work table if it matches the
+ * id in work->device_id and return a pointer to the work but it will not free the
  * work. It may return NULL if it cannot find matching work. */
 static struct work *take_work_by_id(struct cgpu_info *cgpu, uint16_t id)
 {
-	struct work *work, *tmp, *ret = NULL;
+	struct cointerra_info *info = cgpu->device_data;
+	struct work *ret;
 
 	wr_lock(&cgpu->qlock);
-	HASH_ITER(hh, cgpu->queued_work, work, tmp) {
-		if (work->subid == id) {
-			ret = work;
-			break;
-		}
-	}
+	ret = work_id_table_take(&info->work_table, be16toh(id));
 	if (ret)
-		__work_completed(cgpu, ret);
+		--cgpu->queued_count;
 	wr_unlock(&cgpu->qlock);
 
 	return ret;
 }
 
-/* This function will look up a work item in the hashtable if it matches the
- * id in work->subid and return a cloned work item if it matches. It may return
+/* This function will look up a work item in the work table if it matches the
+ * id in work->device_id and return a cloned work item if it matches. It may return
  * NULL if it cannot find matching work. */
 static struct work *clone_work_by_id(struct cgpu_info *cgpu, uint16_t id)
 {
-	struct work *work, *tmp, *ret = NULL;
+	struct cointerra_info *info = cgpu->device_data;
+	struct work *ret;
 
 	rd_lock(&cgpu->qlock);
-	HASH_ITER(hh, cgpu->queued_work, work, tmp) {
-		if (work->subid == id) {
-			ret = work;
-			break;
-		}
-	}
+	ret = work_id_table_find(&info->work_table, be16toh(id));
 	if (ret)
 		ret = copy_work(ret);
 	rd_unlock(&cgpu->qlock);
@@ -897,6 +887,8 @@ static bool cta_prepare(struct thr_info *thr)
 	
 	if (unlikely(!info))
 		quit(1, "Failed to calloc info in cta_detect_one");
+	// Work ids are 16-bit, so each has its own slot
+	work_id_table_init(&info->work_table, 0x10000);
 	for_each_managed_proc(proc, cointerra)
 		proc->device_data = info;
 	/* Nominally set a requested value when starting, preempting the need
@@ -942,6 +934,15 @@ static void cta_send_reset(struct cgpu_info *cointerra, struct cointerra_info *i
 			   uint8_t reset_type, uint8_t diffbits);
 static void cta_flush_work(struct cgpu_info *cointerra);
 
+static
+int cointerra_queue_space(struct thr_info * const thr)
+{
+	struct cgpu_info * const dev = thr->cgpu->device;
+	struct cointerra_info * const devstate = dev->device_data;
+	
+	return devstate->requested;
+}
+
 static
 bool cointerra_queue_append(struct thr_info * const thr, struct work * const work)
 {
@@ -987,11 +988,21 @@ bool cointerra_queue_append(struct thr_info * const thr, struct work * const wor
 	if (!cointerra_write_msg(devstate->ep, cointerra_drv.dname, CMTO_WORK, buf))
 		return false;
 	
-// 	HASH_ADD_INT(master_thr->work, device_id, work);
 	{
-		++dev->queued_count;
+		struct work *old_work;
+		
 		timer_set_now(&work->tv_work_start);
-		HASH_ADD_INT(dev->queued_work, id, work);
+		wr_lock(&dev->qlock);
+		++dev->queued_count;
+		old_work = work_id_table_add(&devstate->work_table, work->device_id, work);
+		if (old_work)
+			--dev->queued_count;
+		wr_unlock(&dev->qlock);
+		if (unlikely(old_work))
+		{
+			applog(LOG_DEBUG, "%s: Work id 0x%04x reused before its work was done", dev->dev_repr, (unsigned)devstate->work_id);
+			free_work(old_work);
+		}
 	}
 	++devstate->work_id;
 	if (!--devstate->requested)
@@ -1125,7 +1136,9 @@ static void cta_scanwork(struct thr_info *thr)
 		/* Discard work that was started more than 5 minutes ago as
 		 * a safety precaution backup in case the hardware failed to
 		 * return a work done message for some work items. */
-		age_queued_work(cointerra, 300.0);
+		wr_lock(&cointerra->qlock);
+		cointerra->queued_count -= work_id_table_age(&info->work_table, 300.0);
+		wr_unlock(&cointerra->qlock);
 
 		/* Each core should be 1.7MH so at max diff of 32 should
 		 * average a share every ~80 seconds.Use this opportunity to
@@ -1167,8 +1180,14 @@ static void cta_scanwork(struct thr_info *thr)
 static void cta_shutdown(struct thr_info *thr)
 {
 	struct cgpu_info *cointerra = thr->cgpu;
+	struct cointerra_info *info = cointerra->device_data;
 
 	cta_close(cointerra);
+
+	wr_lock(&cointerra->qlock);
+	work_id_table_free(&info->work_table);
+	cointerra->queued_count = 0;
+	wr_unlock(&cointerra->qlock);
 }
 
 static void cta_zero_stats(struct cgpu_info *cointerra)
@@ -1361,6 +1380,7 @@ struct device_drv cointerra_drv = {
 	.thread_init = cta_prepare,
 	.minerloop = minerloop_queue,
 	.queue_append = cointerra_queue_append,
+	.queue_space = cointerra_queue_space,
 	.queue_flush = cointerra_queue_flush,
 	// TODO .update_work = cta_update_work,
 	.poll = cta_scanwork,
@@ -210,6 +210,8 @@ struct cointerra_info {
 	struct timeval core_hash_start;
 	int requested;
 	uint16_t work_id;
+	// Queued work indexed by subid, the work id as sent to the device
+	struct work_id_table work_table;
 	int no_matching_work;
 	time_t last_pipe_nonce[1024];
 	unsigned char pipe_bitmap[128];
@@ -12,6 +12,7 @@
 #include "config.h"
 
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,7 +45,9 @@
 BFG_REGISTER_DRIVER(cpu_drv)
 
 #if defined(__linux) && defined(CPU_ZERO)  /* Linux specific policy and affinity management */
+#include <dirent.h>
 #include <sched.h>
+#define HAVE_CPU_TOPOLOGY
 static inline void drop_policy(void)
 {
 	struct sched_param param;
@@ -67,6 +70,106 @@ static inline void affine_to_cpu(int id, int cpu)
 	sched_setaffinity(0, sizeof(set), &set);
 	applog(LOG_INFO, "Binding cpu mining thread %d to cpu %d", id, cpu);
 }
+
+struct cpu_topology_ent {
+	int cpu;
+	int node;
+	int package;
+	int core;
+	int sibling;
+};
+
+static
+int cpu_topology_read_int(const int cpu, const char * const attr, const int def)
+{
+	char filename[0x80], buf[0x10];
+	snprintf(filename, sizeof(filename), "/sys/devices/system/cpu/cpu%d/%s", cpu, attr);
+	if (!bfg_slurp_file(buf, sizeof(buf), filename))
+		return def;
+	return atoi(buf);
+}
+
+static
+int cpu_topology_node(const int cpu)
+{
+	char dirname[0x40];
+	struct dirent *de;
+	int node = 0;
+	snprintf(dirname, sizeof(dirname), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR * const D = opendir(dirname);
+	if (!D)
+		return 0;
+	while ( (de = readdir(D)) )
+		if (!strncmp(de->d_name, "node", 4) && isdigit(de->d_name[4]))
+		{
+			node = atoi(&de->d_name[4]);
+			break;
+		}
+	closedir(D);
+	return node;
+}
+
+static
+int cpu_topology_cmp(const void * const ap, const void * const bp)
+{
+	const struct cpu_topology_ent * const a = ap, * const b = bp;
+	// Spread across physical cores before doubling up on SMT siblings, and keep NUMA nodes contiguous
+	if (a->sibling != b->sibling)
+		return a->sibling - b->sibling;
+	if (a->node != b->node)
+		return a->node - b->node;
+	if (a->package != b->package)
+		return a->package - b->package;
+	if (a->core != b->core)
+		return a->core - b->core;
+	return a->cpu - b->cpu;
+}
+
+// Returns a malloc'd list of logical CPU numbers in placement order, or NULL if the topology is unknown
+static
+int *cpu_topology_placement(const int ncpus, const enum cpu_affinity_policy policy, int * const out_count)
+{
+	struct cpu_topology_ent *ents = malloc(sizeof(*ents) * ncpus);
+	int i, j, count = 0;
+	
+	for (i = 0; i < ncpus; ++i)
+	{
+		if (!cpu_topology_read_int(i, "online", 1))
+			continue;
+		struct cpu_topology_ent * const ent = &ents[count];
+		*ent = (struct cpu_topology_ent){
+			.cpu = i,
+			.node = cpu_topology_node(i),
+			.package = cpu_topology_read_int(i, "topology/physical_package_id", -1),
+			.core = cpu_topology_read_int(i, "topology/core_id", -1),
+		};
+		if (ent->core == -1)
+		{
+			// No topology information exported
+			free(ents);
+			return NULL;
+		}
+		for (j = 0; j < count; ++j)
+			if (ents[j].package == ent->package && ents[j].core == ent->core)
+				++ent->sibling;
+		++count;
+	}
+	
+	qsort(ents, count, sizeof(*ents), cpu_topology_cmp);
+	
+	int * const placement = malloc(sizeof(*placement) * count);
+	for (i = j = 0; i < count; ++i)
+	{
+		if (policy == CAP_CORE && ents[i].sibling)
+			break;
+		applog(LOG_DEBUG, "CPU placement %d: cpu %d (node %d, package %d, core %d, sibling %d)",
+		       j, ents[i].cpu, ents[i].node, ents[i].package, ents[i].core, ents[i].sibling);
+		placement[j++] = ents[i].cpu;
+	}
+	free(ents);
+	*out_count = j;
+	return placement;
+}
 #else
 static inline void drop_policy(void)
 {
@@ -173,6 +276,10 @@ enum sha256_algos opt_algo = ALGO_FASTAUTO;
 
 static bool forced_n_threads;
 
+enum cpu_affinity_policy opt_cpu_affinity = CAP_LEGACY;
+static int *cpu_placement;
+static int cpu_placement_count;
+
 #ifdef USE_SHA256D
 const uint32_t hash1_init[] = {
 	0,0,0,0,0,0,0,0,
@@ -645,6 +752,24 @@ char *force_nthreads_int(const char *arg, int *i)
 	return set_int_range(arg, i, 0, 9999);
 }
 
+char *set_cpu_affinity(const char *arg, enum cpu_affinity_policy *policy)
+{
+	if (!strcasecmp(arg, "auto"))
+		*policy = CAP_LEGACY;
+	else
+	if (!strcasecmp(arg, "none"))
+		*policy = CAP_NONE;
+	else
+	if (!strcasecmp(arg, "core"))
+		*policy = CAP_CORE;
+	else
+	if (!strcasecmp(arg, "smt"))
+		*policy = CAP_SMT;
+	else
+		return "Unknown CPU affinity policy";
+	return NULL;
+}
+
 static int cpu_autodetect()
 {
 	RUNONCE(0);
@@ -682,8 +807,24 @@ static int cpu_autodetect()
 		num_processors = 1;
 	#endif /* !WIN32 */
 
-	if (opt_n_threads < 0 || !forced_n_threads) {
-			opt_n_threads = num_processors;
+#ifdef HAVE_CPU_TOPOLOGY
+	if (opt_cpu_affinity == CAP_CORE || opt_cpu_affinity == CAP_SMT)
+	{
+		cpu_placement = cpu_topology_placement(num_processors, opt_cpu_affinity, &cpu_placement_count);
+		if (!cpu_placement)
+			applog(LOG_WARNING, "Unable to read CPU topology; not binding CPU mining threads");
+		else
+		if (opt_n_threads < 0 || !forced_n_threads)
+			opt_n_threads = cpu_placement_count;
+	}
+#else
+	if (opt_cpu_affinity == CAP_CORE || opt_cpu_affinity == CAP_SMT)
+		applog(LOG_WARNING, "CPU topology is not supported on this platform; not binding CPU mining threads");
+#endif
+
+	// With a placement, the thread count was already set from it above
+	if (!cpu_placement && (opt_n_threads < 0 || !forced_n_threads)) {
+		opt_n_threads = num_processors;
 	}
 	if (num_processors < 1)
 		return 0;
@@ -712,13 +853,20 @@ static void cpu_detect()
 }
 
 static pthread_mutex_t cpualgo_lock;
+static struct nonce_partition *cpu_nonce_partition;
 
 static bool cpu_thread_prepare(struct thr_info *thr)
 {
 	struct cgpu_info *cgpu = thr->cgpu;
 	
 	if (!(cgpu->device_id || thr->device_thread || cgpu->proc_id))
+	{
 		mutex_init(&cpualgo_lock);
+		// All CPU threads scan disjoint nonce ranges of the same work
+		if (opt_n_threads > 1)
+			cpu_nonce_partition = nonce_partition_new(opt_n_threads);
+	}
+	cgpu->nonce_partition = cpu_nonce_partition;
 	
 	thread_reportin(thr);
 
@@ -733,6 +881,18 @@ static uint64_t cpu_can_limit_work(struct thr_info __maybe_unused *thr)
 static bool cpu_thread_init(struct thr_info *thr)
 {
 	const int thr_id = thr->id;
+	
+	/* Bind before benchmarking, so the (forked) benchmark measures the
+	 * placement we will actually mine with, and so anything this thread
+	 * allocates from here on is first-touched on its own NUMA node */
+	if (cpu_placement)
+		affine_to_cpu(dev_from_id(thr_id), cpu_placement[dev_from_id(thr_id) % cpu_placement_count]);
+	else
+	/* Cpu affinity only makes sense if the number of threads is a multiple
+	 * of the number of CPUs */
+	if (opt_cpu_affinity == CAP_LEGACY && num_processors > 1 && opt_n_threads % num_processors == 0)
+		affine_to_cpu(dev_from_id(thr_id), dev_from_id(thr_id) % num_processors);
+	
 #ifdef USE_SHA256D
 	struct cgpu_info *cgpu = thr->cgpu;
 
@@ -755,10 +915,6 @@ static bool cpu_thread_init(struct thr_info *thr)
 	 * error if it fails */
 	setpriority(PRIO_PROCESS, 0, 19);
 	drop_policy();
-	/* Cpu affinity only makes sense if the number of threads is a multiple
-	 * of the number of CPUs */
-	if (num_processors > 1 && opt_n_threads % num_processors == 0)
-		affine_to_cpu(dev_from_id(thr_id), dev_from_id(thr_id) % num_processors);
 	return true;
 }
 
@@ -78,14 +78,23 @@ enum sha256_algos {
 	CUSTOM_CPU_MINING_ALGOS_COUNT,
 };
 
+enum cpu_affinity_policy {
+	CAP_LEGACY,		/* bind only if threads are a multiple of CPUs */
+	CAP_NONE,		/* never bind */
+	CAP_CORE,		/* one thread per physical core */
+	CAP_SMT,		/* one thread per SMT sibling, cores filled first */
+};
+
 extern const char *algo_names[];
 extern struct device_drv cpu_drv;
+extern enum cpu_affinity_policy opt_cpu_affinity;
 
 extern const uint32_t hash1_init[];
 
 extern char *set_algo(const char *arg, enum sha256_algos *algo);
 extern void show_algo(char buf[OPT_SHOW_LEN], const enum sha256_algos *algo);
 extern char *force_nthreads_int(const char *arg, int *i);
+extern char *set_cpu_affinity(const char *arg, enum cpu_affinity_policy *policy);
 extern void init_max_name_len();
 extern double bench_algo_stage3(enum sha256_algos algo);
 extern void set_scrypt_algo(enum sha256_algos *algo);
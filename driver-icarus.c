@@ -142,6 +142,11 @@ static const char *MODE_UNKNOWN_STR = "unknown";
 #define END_CONDITION 0x0000ffff
 #define DEFAULT_DETECT_THRESHOLD 1
 
+// Weight given to each new nonce in the running Hs estimate
+#define HS_EWMA_WEIGHT 0.05
+// Samples needed before the running estimate may adjust read_timeout_ms
+#define HS_EWMA_MIN_SAMPLES 20
+
 BFG_REGISTER_DRIVER(icarus_drv)
 extern const struct bfg_set_device_definition icarus_set_device_funcs[];
 extern const struct bfg_set_device_definition icarus_set_device_funcs_live[];
@@ -176,11 +181,20 @@ int icarus_read(const char * const repr, uint8_t *buf, const int fd, struct time
 	
 #ifdef HAVE_EPOLL
 	bool watching_work_restart = !thr;
+	struct icarus_state * const state = thr ? thr->cgpu_data : NULL;
+	bool epoll_kept = false;
 	int epollfd;
 	struct epoll_event evr[2];
 	
-	epollfd = epoll_create(2);
-	if (epollfd != -1) {
+	if (state && state->epollfd != -1 && state->epoll_devfd == fd)
+	{
+		// Reuse the set from earlier reads, rather than making one per read
+		epollfd = state->epollfd;
+		watching_work_restart = state->epoll_watching_work_restart;
+		epoll_kept = true;
+	}
+	else
+	if ((epollfd = epoll_create(2)) != -1) {
 		struct epoll_event ev = {
 			.events = EPOLLIN,
 			.data.fd = fd,
@@ -199,6 +213,15 @@ int icarus_read(const char * const repr, uint8_t *buf, const int fd, struct time
 			else
 				watching_work_restart = true;
 		}
+		if (epollfd != -1 && state)
+		{
+			if (state->epollfd != -1)
+				close(state->epollfd);
+			state->epollfd = epollfd;
+			state->epoll_devfd = fd;
+			state->epoll_watching_work_restart = watching_work_restart;
+			epoll_kept = true;
+		}
 	}
 	else
 		applog(LOG_DEBUG, "%s: Error creating epoll", repr);
@@ -284,7 +307,7 @@ int icarus_read(const char * const repr, uint8_t *buf, const int fd, struct time
 
 out:
 #ifdef HAVE_EPOLL
-	if (epollfd != -1)
+	if (epollfd != -1 && !epoll_kept)
 		close(epollfd);
 #endif
 	return rv;
@@ -313,6 +336,14 @@ void do_icarus_close(struct thr_info *thr)
 {
 	struct cgpu_info *icarus = thr->cgpu;
 	const int fd = icarus->device_fd;
+#ifdef HAVE_EPOLL
+	struct icarus_state * const state = thr->cgpu_data;
+	if (state && state->epollfd != -1)
+	{
+		close(state->epollfd);
+		state->epollfd = -1;
+	}
+#endif
 	if (fd == -1)
 		return;
 	icarus_close(fd);
@@ -430,6 +461,7 @@ const char *_icarus_set_timing(struct ICARUS_INFO * const info, const char * con
 	}
 
 	info->min_data_count = MIN_DATA_COUNT;
+	info->Hs_ewma_samples = 0;
 
 	applog(LOG_DEBUG, "%s: Init: mode=%s read_timeout_ms=%u limit=%dms Hs=%e",
 		repr,
@@ -706,6 +738,7 @@ static bool icarus_prepare(struct thr_info *thr)
 	struct icarus_state *state;
 	thr->cgpu_data = state = calloc(1, sizeof(*state));
 	state->firstrun = true;
+	state->epollfd = -1;
 
 #ifdef HAVE_EPOLL
 	int epollfd = epoll_create(2);
@@ -918,6 +951,62 @@ void icarus_transition_work(struct icarus_state *state, struct work *work)
 	state->last_work = copy_work(work);
 }
 
+// Time to search the whole nonce range, less a millisecond, within read_count_limit
+static
+unsigned icarus_fullnonce_read_timeout_ms(const struct ICARUS_INFO * const info, const double fullnonce, bool * const out_limited)
+{
+	unsigned read_timeout_ms = fullnonce * 1000;
+	
+	if (read_timeout_ms > 0)
+		--read_timeout_ms;
+	*out_limited = (info->read_count_limit > 0 && read_timeout_ms > info->read_count_limit * 100);
+	if (*out_limited)
+		read_timeout_ms = info->read_count_limit * 100;
+	return read_timeout_ms;
+}
+
+// Keep refining Hs from every good nonce, even once the timing history is
+// done, so that read_timeout_ms follows clock changes and drift without
+// another calibration run
+static
+void icarus_update_hs_ewma(struct cgpu_info * const icarus, struct ICARUS_INFO * const info, const int64_t hash_count, const struct timeval * const elapsed)
+{
+	double Ti, Hs, fullnonce;
+	unsigned read_timeout_ms;
+	bool limited;
+	
+	Ti = (double)elapsed->tv_sec
+		+ ((double)elapsed->tv_usec) / 1000000.
+		- ICARUS_READ_TIME(info->baud, info->read_size)
+		- info->W;
+	if (Ti <= 0 || hash_count <= 0)
+		return;
+	Hs = Ti / (double)hash_count;
+	
+	if (info->Hs_ewma_samples)
+		info->Hs_ewma += (Hs - info->Hs_ewma) * HS_EWMA_WEIGHT;
+	else
+		info->Hs_ewma = Hs;
+	++info->Hs_ewma_samples;
+	
+	// Only take over the timeout once short timing has finished calibrating;
+	// other modes are either user values or have their own driver timeouts
+	if (info->timing_mode != MODE_SHORT || info->do_icarus_timing || info->Hs_ewma_samples < HS_EWMA_MIN_SAMPLES)
+		return;
+	
+	fullnonce = info->W + info->Hs_ewma * (((double)0xffffffff) + 1);
+	read_timeout_ms = icarus_fullnonce_read_timeout_ms(info, fullnonce, &limited);
+	if (!read_timeout_ms)
+		return;
+	
+	if (read_timeout_ms != info->read_timeout_ms)
+		applog(LOG_DEBUG, "%s: Running estimate: Hs=%e read_timeout_ms=%u fullnonce=%.3fs",
+		       icarus->dev_repr, info->Hs_ewma, read_timeout_ms, fullnonce);
+	info->Hs = info->Hs_ewma;
+	info->fullnonce = fullnonce;
+	info->read_timeout_ms = read_timeout_ms;
+}
+
 static int64_t icarus_scanhash(struct thr_info *thr, struct work *work,
 				__maybe_unused int64_t max_nonce)
 {
@@ -1183,6 +1272,11 @@ keepwaiting:
 		}
 	}
 
+	if (!was_hw_error
+	&&  ((nonce & info->nonce_mask) > END_CONDITION)
+	&&  ((nonce & info->nonce_mask) < (info->nonce_mask & ~END_CONDITION)))
+		icarus_update_hs_ewma(icarus, info, hash_count, &elapsed);
+
 	// Ignore possible end condition values ... and hw errors
 	// TODO: set limitations on calculated values depending on the device
 	// to avoid crap values caused by CPU/Task Switching/Swapping/etc
@@ -1257,14 +1351,7 @@ keepwaiting:
 			memset(history0, 0, sizeof(struct ICARUS_HISTORY));
 
 			fullnonce = W + Hs * (((double)0xffffffff) + 1);
-			read_timeout_ms = fullnonce * 1000;
-			if (read_timeout_ms > 0)
-				--read_timeout_ms;
-			if (info->read_count_limit > 0 && read_timeout_ms > info->read_count_limit * 100) {
-				read_timeout_ms = info->read_count_limit * 100;
-				limited = true;
-			} else
-				limited = false;
+			read_timeout_ms = icarus_fullnonce_read_timeout_ms(info, fullnonce, &limited);
 
 			info->Hs = Hs;
 			info->read_timeout_ms = read_timeout_ms;
@@ -1329,6 +1416,8 @@ static struct api_data *icarus_drv_stats(struct cgpu_info *cgpu)
 	root = api_add_int(root, "count", &(info->count), false);
 	root = api_add_hs(root, "Hs", &(info->Hs), false);
 	root = api_add_double(root, "W", &(info->W), false);
+	root = api_add_hs(root, "Hs_ewma", &(info->Hs_ewma), false);
+	root = api_add_uint(root, "Hs_ewma_samples", &(info->Hs_ewma_samples), false);
 	root = api_add_uint(root, "total_values", &(info->values), false);
 	root = api_add_uint64(root, "range", &(info->hash_count_range), false);
 	root = api_add_uint64(root, "history_count", &(info->history_count), false);
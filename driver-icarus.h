@@ -101,6 +101,9 @@ struct ICARUS_INFO {
 	// Used to calculate / display hash count when nonce is NOT found
 	// seconds per Hash
 	double Hs;
+	// Running (EWMA) estimate of Hs, updated from every good nonce
+	double Hs_ewma;
+	uint32_t Hs_ewma_samples;
 	
 	// Used to calculate / display hash count when a nonce is found
 	int work_division;
@@ -155,6 +158,11 @@ struct icarus_state {
 	bool identify;
 	
 	uint8_t *ob_bin;
+	
+	// epoll set kept by icarus_read while epoll_devfd stays open
+	int epollfd;
+	int epoll_devfd;
+	bool epoll_watching_work_restart;
 };
 
 extern struct cgpu_info *icarus_detect_custom(const char *devpath, struct device_drv *, struct ICARUS_INFO *);
@@ -95,6 +95,7 @@ int metabank_autodetect()
 			
 			port = malloc(sizeof(*port));
 			*port = *sys_spi;
+			port->fd = -1;
 			port->cgpu = &dummy_cgpu;
 			port->txrx = metabank_spi_txrx;
 			dummy_bitfury.slot = i;
@@ -131,7 +132,10 @@ int metabank_autodetect()
 				prev_cgpu = cgpu;
 			}
 			else
+			{
+				spi_close(port);
 				free(port);
+			}
 		}
 	}
 	
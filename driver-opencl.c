@@ -1634,6 +1634,10 @@ static bool opencl_thread_prepare(struct thr_info *thr)
 		applog(LOG_ERR, "Failed to calloc in opencl_thread_init");
 		return false;
 	}
+	
+	// All threads of a GPU scan disjoint nonce ranges of the same work
+	if (cgpu->threads > 1 && !cgpu->nonce_partition)
+		cgpu->nonce_partition = nonce_partition_new(cgpu->threads);
 
 	strcpy(name, "");
 	applog(LOG_INFO, "Init GPU thread %i GPU %i virtual GPU %i", i, gpu, virtual_gpu);
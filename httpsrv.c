@@ -18,6 +18,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifndef WIN32
 #include <sys/types.h>
@@ -26,6 +27,8 @@
 #endif
 
 #include <microhttpd.h>
+#include <pthread.h>
+#include <utlist.h>
 
 #include "logging.h"
 #include "miner.h"
@@ -40,9 +43,160 @@ void httpsrv_prepare_resp(struct MHD_Response *resp)
 	MHD_add_response_header(resp, MHD_HTTP_HEADER_SERVER, bfgminer_name_slash_ver);
 }
 
+// Scrapes within this many seconds get the same snapshot
+#define METRICS_SNAPSHOT_INTERVAL  1
+
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bytes_t metrics_snapshot = BYTES_INIT;
+static struct timeval tv_metrics_snapshot;
+
+static
+void metrics_append(bytes_t * const b, const char * const fmt, ...)
+{
+	char buf[0x200];
+	va_list ap;
+	int n;
+	
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n >= (int)sizeof(buf))
+		n = sizeof(buf) - 1;
+	if (n > 0)
+		bytes_append(b, buf, n);
+}
+
+// Escapes a string for use as a label value
+static
+void metrics_label_value(char * const out, const size_t outsz, const char *s)
+{
+	size_t i = 0;
+	
+	for ( ; *s && i + 2 < outsz; ++s)
+	{
+		if (*s == '\\' || *s == '"')
+			out[i++] = '\\';
+		else
+		if (*s == '\n')
+		{
+			out[i++] = '\\';
+			out[i++] = 'n';
+			continue;
+		}
+		out[i++] = *s;
+	}
+	out[i] = '\0';
+}
+
+/* Counters are read without taking any of the miner's locks: they are only
+ * ever updated in place, so a racy read is at worst slightly out of date */
+static
+void metrics_render(bytes_t * const b)
+{
+	struct cgpu_info *proc;
+	struct pool *pool;
+	struct mining_algorithm *malgo;
+	char url[0x100];
+	int i, j, staged = 0;
+	
+	bytes_reset(b);
+	
+	metrics_append(b, "# TYPE bfgminer_proc_hashrate_mhs gauge\n");
+	for (i = 0; i < total_devices; ++i)
+	{
+		proc = get_devices(i);
+		metrics_append(b, "bfgminer_proc_hashrate_mhs{proc=\"%s\"} %f\n", proc->proc_repr_ns, proc->rolling);
+	}
+	metrics_append(b, "# TYPE bfgminer_proc_temperature_celsius gauge\n");
+	for (i = 0; i < total_devices; ++i)
+	{
+		proc = get_devices(i);
+		if (proc->temp)
+			metrics_append(b, "bfgminer_proc_temperature_celsius{proc=\"%s\"} %.1f\n", proc->proc_repr_ns, proc->temp);
+	}
+	metrics_append(b, "# TYPE bfgminer_proc_shares_total counter\n");
+	for (i = 0; i < total_devices; ++i)
+	{
+		proc = get_devices(i);
+		metrics_append(b, "bfgminer_proc_shares_total{proc=\"%s\",result=\"accepted\"} %d\n", proc->proc_repr_ns, proc->accepted);
+		metrics_append(b, "bfgminer_proc_shares_total{proc=\"%s\",result=\"rejected\"} %d\n", proc->proc_repr_ns, proc->rejected);
+		metrics_append(b, "bfgminer_proc_shares_total{proc=\"%s\",result=\"stale\"} %d\n", proc->proc_repr_ns, proc->stale);
+	}
+	metrics_append(b, "# TYPE bfgminer_proc_hw_errors_total counter\n");
+	for (i = 0; i < total_devices; ++i)
+	{
+		proc = get_devices(i);
+		metrics_append(b, "bfgminer_proc_hw_errors_total{proc=\"%s\"} %d\n", proc->proc_repr_ns, proc->hw_errors);
+	}
+	
+	metrics_append(b, "# TYPE bfgminer_pool_shares_total counter\n");
+	for (i = 0; i < total_pools; ++i)
+	{
+		pool = pools[i];
+		metrics_label_value(url, sizeof(url), pool->rpc_url);
+		metrics_append(b, "bfgminer_pool_shares_total{pool=\"%d\",url=\"%s\",result=\"accepted\"} %d\n", pool->pool_no, url, pool->accepted);
+		metrics_append(b, "bfgminer_pool_shares_total{pool=\"%d\",url=\"%s\",result=\"rejected\"} %d\n", pool->pool_no, url, pool->rejected);
+		metrics_append(b, "bfgminer_pool_shares_total{pool=\"%d\",url=\"%s\",result=\"stale\"} %u\n", pool->pool_no, url, pool->stale_shares);
+	}
+	metrics_append(b, "# TYPE bfgminer_pool_bytes_total counter\n");
+	for (i = 0; i < total_pools; ++i)
+	{
+		pool = pools[i];
+		const struct cgminer_pool_stats * const pool_stats = &pool->cgminer_pool_stats;
+		metrics_append(b, "bfgminer_pool_bytes_total{pool=\"%d\",direction=\"sent\"} %"PRIu64"\n", pool->pool_no, pool_stats->net_bytes_sent);
+		metrics_append(b, "bfgminer_pool_bytes_total{pool=\"%d\",direction=\"received\"} %"PRIu64"\n", pool->pool_no, pool_stats->net_bytes_received);
+	}
+	metrics_append(b, "# TYPE bfgminer_pool_submit_latency_seconds histogram\n");
+	for (i = 0; i < total_pools; ++i)
+	{
+		pool = pools[i];
+		const struct cgminer_pool_stats * const pool_stats = &pool->cgminer_pool_stats;
+		uint32_t cumulative = 0;
+		for (j = 0; j < POOL_SUBMIT_LATENCY_BUCKETS; ++j)
+		{
+			cumulative += pool_stats->submit_latency_hist[j];
+			metrics_append(b, "bfgminer_pool_submit_latency_seconds_bucket{pool=\"%d\",le=\"%g\"} %lu\n", pool->pool_no, pool_submit_latency_bounds[j], (unsigned long)cumulative);
+		}
+		cumulative += pool_stats->submit_latency_hist[j];
+		metrics_append(b, "bfgminer_pool_submit_latency_seconds_bucket{pool=\"%d\",le=\"+Inf\"} %lu\n", pool->pool_no, (unsigned long)cumulative);
+		metrics_append(b, "bfgminer_pool_submit_latency_seconds_sum{pool=\"%d\"} %f\n", pool->pool_no, pool_stats->submit_latency_sum);
+		metrics_append(b, "bfgminer_pool_submit_latency_seconds_count{pool=\"%d\"} %lu\n", pool->pool_no, (unsigned long)pool_stats->submit_latency_count);
+	}
+	
+	LL_FOREACH(mining_algorithms, malgo)
+		staged += malgo->staged;
+	metrics_append(b, "# TYPE bfgminer_staged_work gauge\nbfgminer_staged_work %d\n", staged);
+	metrics_append(b, "# TYPE bfgminer_hashrate_mhs gauge\nbfgminer_hashrate_mhs %f\n", total_rolling);
+	metrics_append(b, "# TYPE bfgminer_hw_errors_total counter\nbfgminer_hw_errors_total %d\n", hw_errors);
+}
+
+static
+int handle_metrics(struct MHD_Connection * const conn)
+{
+	struct MHD_Response *resp;
+	int ret;
+	
+	mutex_lock(&metrics_mutex);
+	if ((!timer_isset(&tv_metrics_snapshot)) || timer_elapsed(&tv_metrics_snapshot, NULL) >= METRICS_SNAPSHOT_INTERVAL)
+	{
+		metrics_render(&metrics_snapshot);
+		timer_set_now(&tv_metrics_snapshot);
+	}
+	resp = MHD_create_response_from_buffer(bytes_len(&metrics_snapshot), bytes_buf(&metrics_snapshot), MHD_RESPMEM_MUST_COPY);
+	mutex_unlock(&metrics_mutex);
+	
+	httpsrv_prepare_resp(resp);
+	MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain; version=0.0.4");
+	ret = MHD_queue_response(conn, 200, resp);
+	MHD_destroy_response(resp);
+	return ret;
+}
+
 static
 int httpsrv_handle_req(struct MHD_Connection *conn, const char *url, const char *method, bytes_t *upbuf)
 {
+	if (!strcmp(url, "/metrics"))
+		return handle_metrics(conn);
 	return handle_getwork(conn, upbuf);
 }
 
@@ -321,31 +321,35 @@ uint32_t bitfury_decnonce(uint32_t in)
 	return out;
 }
 
+void bitfury_rehash_prepare(struct bitfury_rehash_state * const state, const void * const midstate, const uint32_t m7, const uint32_t ntime, const uint32_t nbits)
+{
+	sha256_ctx * const ctx = &state->ctx;
+	const uint32_t in32[3] = {
+		bswap_32(m7),
+		bswap_32(ntime),
+		bswap_32(nbits),
+	};
+	
+	memset(ctx, 0, sizeof(*ctx));
+	memcpy(ctx->h, midstate, 8*4);
+	ctx->tot_len = 64;
+	ctx->len = 0;
+	// Buffered in the context, so only the nonce remains per candidate
+	sha256_update(ctx, (const unsigned char *)in32, sizeof(in32));
+}
+
 static
-int libbitfury_rehash(const void *midstate, const uint32_t m7, const uint32_t ntime, const uint32_t nbits, uint32_t nnonce) {
-	uint8_t in[16];
-	uint32_t *in32 = (uint32_t *)in;
-	const uint32_t *mid32 = midstate;
+int libbitfury_rehash(const struct bitfury_rehash_state * const state, const uint32_t nnonce) {
+	const uint32_t in32 = bswap_32(nnonce);
 	uint32_t out32[8];
 	uint8_t *out = (uint8_t *) out32;
 #ifdef BITFURY_REHASH_DEBUG
 	static uint32_t history[512];
 	static uint32_t history_p;
 #endif
-	sha256_ctx ctx;
-
-
-	memset( &ctx, 0, sizeof( sha256_ctx ) );
-	memcpy(ctx.h, mid32, 8*4);
-	ctx.tot_len = 64;
-	ctx.len = 0;
+	sha256_ctx ctx = state->ctx;
 
-	in32[0] = bswap_32(m7);
-	in32[1] = bswap_32(ntime);
-	in32[2] = bswap_32(nbits);
-	in32[3] = bswap_32(nnonce);
-
-	sha256_update(&ctx, in, 16);
+	sha256_update(&ctx, (const unsigned char *)&in32, 4);
 	sha256_final(&ctx, out);
 	sha256(out, 32, out);
 
@@ -353,7 +357,7 @@ int libbitfury_rehash(const void *midstate, const uint32_t m7, const uint32_t nt
 #ifdef BITFURY_REHASH_DEBUG
 		char hex[65];
 		bin2hex(hex, out, 32);
-		applog(LOG_INFO, "! MS0: %08x, m7: %08x, ntime: %08x, nbits: %08x, nnonce: %08x", mid32[0], m7, ntime, nbits, nnonce);
+		applog(LOG_INFO, "! MS0: %08x, nnonce: %08x", state->ctx.h[0], nnonce);
 		applog(LOG_INFO, " out: %s", hex);
 		history[history_p] = nnonce;
 		history_p++; history_p &= 512 - 1;
@@ -363,7 +367,7 @@ int libbitfury_rehash(const void *midstate, const uint32_t m7, const uint32_t nt
 	return 0;
 }
 
-bool bitfury_fudge_nonce(const void *midstate, const uint32_t m7, const uint32_t ntime, const uint32_t nbits, uint32_t *nonce_p) {
+bool bitfury_fudge_nonce_prepared(const struct bitfury_rehash_state * const state, uint32_t * const nonce_p) {
 	static const uint32_t offsets[] = {0, 0xffc00000, 0xff800000, 0x02800000, 0x02C00000, 0x00400000};
 	uint32_t nonce;
 	int i;
@@ -371,7 +375,7 @@ bool bitfury_fudge_nonce(const void *midstate, const uint32_t m7, const uint32_t
 	for (i = 0; i < 6; ++i)
 	{
 		nonce = *nonce_p + offsets[i];
-		if (libbitfury_rehash(midstate, m7, ntime, nbits, nonce))
+		if (libbitfury_rehash(state, nonce))
 		{
 			*nonce_p = nonce;
 			return true;
@@ -380,6 +384,13 @@ bool bitfury_fudge_nonce(const void *midstate, const uint32_t m7, const uint32_t
 	return false;
 }
 
+bool bitfury_fudge_nonce(const void *midstate, const uint32_t m7, const uint32_t ntime, const uint32_t nbits, uint32_t *nonce_p) {
+	struct bitfury_rehash_state state;
+	
+	bitfury_rehash_prepare(&state, midstate, m7, ntime, nbits);
+	return bitfury_fudge_nonce_prepared(&state, nonce_p);
+}
+
 void work_to_bitfury_payload(struct bitfury_payload *p, struct work *w) {
 	memset(p, 0, sizeof(struct bitfury_payload));
 
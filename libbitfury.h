@@ -6,6 +6,7 @@
 
 #include "lowl-spi.h"
 #include "miner.h"
+#include "sha2.h"
 
 struct work;
 
@@ -41,6 +42,8 @@ struct bitfury_device {
 	int chipgen;
 	int chipgen_probe;
 	uint32_t atrvec[20];
+	// atrvec as an SPI data frame; cleared by bitfury_atrvec_changed, and rebuilt when next sent
+	uint8_t atrvec_frame[3 + (19 * 4)];
 	struct bitfury_payload payload;
 	struct freq_stat chip_stat;
 	struct timeval timer1;
@@ -60,6 +63,12 @@ struct bitfury_device {
 
 extern void work_to_bitfury_payload(struct bitfury_payload *, struct work *);
 extern void bitfury_payload_to_atrvec(uint32_t *atrvec, struct bitfury_payload *);
+
+static inline
+void bitfury_atrvec_changed(struct bitfury_device * const bitfury)
+{
+	bitfury->atrvec_frame[0] = 0;
+}
 extern void bitfury_send_reinit(struct spi_port *, int slot, int chip_n, int n);
 extern void bitfury_send_shutdown(struct spi_port *, int slot, int chip_n);
 extern void bitfury_send_freq(struct spi_port *, int slot, int chip_n, int bits);
@@ -67,4 +76,11 @@ extern int libbitfury_detectChips1(struct spi_port *);
 extern uint32_t bitfury_decnonce(uint32_t);
 extern bool bitfury_fudge_nonce(const void *midstate, const uint32_t m7, const uint32_t ntime, const uint32_t nbits, uint32_t *nonce_p);
 
+// SHA256 state for a job, shared by all its candidate nonces
+struct bitfury_rehash_state {
+	sha256_ctx ctx;
+};
+extern void bitfury_rehash_prepare(struct bitfury_rehash_state *, const void *midstate, uint32_t m7, uint32_t ntime, uint32_t nbits);
+extern bool bitfury_fudge_nonce_prepared(const struct bitfury_rehash_state *, uint32_t *nonce_p);
+
 #endif /* __LIBBITFURY_H__ */
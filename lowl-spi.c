@@ -27,6 +27,7 @@
 #define HAVE_LINUX_SPI
 #endif
 
+#include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
@@ -81,10 +82,19 @@ void spi_init(void)
 	sys_spi = malloc(sizeof(*sys_spi));
 	*sys_spi = (struct spi_port){
 		.txrx = sys_spi_txrx,
+		.fd = -1,
 	};
 #endif
 }
 
+void spi_close(struct spi_port * const port)
+{
+	if (port->fd == -1)
+		return;
+	close(port->fd);
+	port->fd = -1;
+}
+
 #ifdef HAVE_LINUX_SPI
 
 int spi_open(struct spi_port * const spi, const char * const devpath)
@@ -168,9 +178,13 @@ int spi_reset(int a)
 #define BAILOUT(s)  do{  \
 	perror(s);  \
 	close(fd);  \
+	port->fd = -1;  \
 	return false;  \
 }while(0)
 
+// Set if the kernel's spidev buffer is too small to take a whole frame in one message
+static bool sys_spi_split_messages;
+
 bool sys_spi_txrx(struct spi_port *port)
 {
 	const void *wrbuf = spi_gettxbuf(port);
@@ -178,7 +192,7 @@ bool sys_spi_txrx(struct spi_port *port)
 	size_t bufsz = spi_getbufsz(port);
 	int fd;
 	int mode, bits, speed, rv, i, j;
-	struct spi_ioc_transfer tr[16];
+	struct spi_ioc_transfer tr[(SPIMAXSZ + 4095) / 4096];
 
 	memset(&tr,0,sizeof(tr));
 	mode = 0; bits = 8; speed = 4000000;
@@ -186,53 +200,69 @@ bool sys_spi_txrx(struct spi_port *port)
 		speed = port->speed;
 
 	spi_reset(1234);
-	fd = open("/dev/spidev0.0", O_RDWR);
+	// The device is kept open and configured between frames
+	fd = port->fd;
 	if (fd < 0) {
-		perror("Unable to open SPI device");
-		return false;
+		fd = open("/dev/spidev0.0", O_RDWR);
+		if (fd < 0) {
+			perror("Unable to open SPI device");
+			return false;
+		}
+		if (ioctl(fd, SPI_IOC_WR_MODE, &mode) < 0)
+			BAILOUT("Unable to set WR MODE");
+		if (ioctl(fd, SPI_IOC_RD_MODE, &mode) < 0)
+			BAILOUT("Unable to set RD MODE");
+		if (ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0)
+			BAILOUT("Unable to set WR_BITS_PER_WORD");
+		if (ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &bits) < 0)
+			BAILOUT("Unable to set RD_BITS_PER_WORD");
+		if (ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)
+			BAILOUT("Unable to set WR_MAX_SPEED_HZ");
+		if (ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed) < 0)
+			BAILOUT("Unable to set RD_MAX_SPEED_HZ");
+		port->fd = fd;
 	}
-	if (ioctl(fd, SPI_IOC_WR_MODE, &mode) < 0)
-		BAILOUT("Unable to set WR MODE");
-	if (ioctl(fd, SPI_IOC_RD_MODE, &mode) < 0)
-		BAILOUT("Unable to set RD MODE");
-	if (ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0)
-		BAILOUT("Unable to set WR_BITS_PER_WORD");
-	if (ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &bits) < 0)
-		BAILOUT("Unable to set RD_BITS_PER_WORD");
-	if (ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)
-		BAILOUT("Unable to set WR_MAX_SPEED_HZ");
-	if (ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed) < 0)
-		BAILOUT("Unable to set RD_MAX_SPEED_HZ");
 
 	rv = 0;
 	while (bufsz >= 4096) {
-                tr[rv].tx_buf = (uintptr_t) wrbuf;
-                tr[rv].rx_buf = (uintptr_t) rdbuf;
-                tr[rv].len = 4096;
-                tr[rv].delay_usecs = 1;
-                tr[rv].speed_hz = speed;
-                tr[rv].bits_per_word = bits;
-                bufsz -= 4096;
-                wrbuf += 4096; rdbuf += 4096; rv ++;
-        }
-        if (bufsz > 0) {
-                tr[rv].tx_buf = (uintptr_t) wrbuf;
-                tr[rv].rx_buf = (uintptr_t) rdbuf;
-                tr[rv].len = (unsigned)bufsz;
-                tr[rv].delay_usecs = 1;
-                tr[rv].speed_hz = speed;
-                tr[rv].bits_per_word = bits;
-                rv ++;
-        }
-
-        i = rv;
-        for (j = 0; j < i; j++) {
-                rv = (int)ioctl(fd, SPI_IOC_MESSAGE(1), (intptr_t)&tr[j]);
+		tr[rv].tx_buf = (uintptr_t) wrbuf;
+		tr[rv].rx_buf = (uintptr_t) rdbuf;
+		tr[rv].len = 4096;
+		tr[rv].delay_usecs = 1;
+		tr[rv].speed_hz = speed;
+		tr[rv].bits_per_word = bits;
+		bufsz -= 4096;
+		wrbuf += 4096; rdbuf += 4096; rv ++;
+	}
+	if (bufsz > 0) {
+		tr[rv].tx_buf = (uintptr_t) wrbuf;
+		tr[rv].rx_buf = (uintptr_t) rdbuf;
+		tr[rv].len = (unsigned)bufsz;
+		tr[rv].delay_usecs = 1;
+		tr[rv].speed_hz = speed;
+		tr[rv].bits_per_word = bits;
+		rv ++;
+	}
+
+	i = rv;
+	if (i > 1 && !sys_spi_split_messages)
+	{
+		// Submit the whole frame at once
+		if (ioctl(fd, SPI_IOC_MESSAGE(i), (intptr_t)&tr[0]) >= 0)
+			goto done;
+		if (errno != EMSGSIZE)
+			BAILOUT("SPI transfer failed");
+		applog(LOG_DEBUG, "%s: spidev buffer too small for %d-transfer messages, splitting them",
+		       __func__, i);
+		sys_spi_split_messages = true;
+	}
+	for (j = 0; j < i; j++) {
+		rv = (int)ioctl(fd, SPI_IOC_MESSAGE(1), (intptr_t)&tr[j]);
 		if (rv < 0)
 			BAILOUT("WTF!");
-        }
+	}
 
-	close(fd);
+done:
 	spi_reset(4321);
 
 	return true;
@@ -345,6 +375,29 @@ void *spi_emit_data(struct spi_port *port, uint16_t addr, const void *buf, size_
 	return spi_emit_buf_reverse(port, buf, len*4);
 }
 
+size_t spi_format_data(void * const out, const uint16_t addr, const void * const buf, size_t len)
+{
+	uint8_t * const otmp = out;
+	const uint8_t * const str = buf;
+	if (len < 4 || len > 128)
+		return 0;  /* This cannot be programmed in single frame! */
+	len /= 4; /* Strip */
+	otmp[0] = (len - 1) | 0xE0;
+	otmp[1] = (addr >> 8)&0xFF; otmp[2] = addr & 0xFF;
+	for (size_t i = 0; i < len * 4; ++i)
+		otmp[3 + i] = bitflip8(str[i]);
+	return 3 + (len * 4);
+}
+
+void *spi_emit_formatted_data(struct spi_port * const port, const void * const frame, const size_t framesz)
+{
+	void * const rv = &port->spibuf_rx[port->spibufsz + 3];
+	if (port->spibufsz + framesz >= SPIMAXSZ)
+		return NULL;
+	spi_emit_buf(port, frame, framesz);
+	return rv;
+}
+
 #ifdef USE_BFSB
 void spi_bfsb_select_bank(int bank)
 {
@@ -82,6 +82,13 @@ extern void spi_emit_nop(struct spi_port *port, int n);
    transmission quantum is 32 bits */
 extern void *spi_emit_data(struct spi_port *port, uint16_t addr, const void *buf, size_t len);
 
+/* Formats the same frame as spi_emit_data into out (which must have room for
+   len+3 bytes), so it can be emitted repeatedly without reformatting.
+   Returns the frame size, or 0 if len is invalid */
+extern size_t spi_format_data(void *out, uint16_t addr, const void *buf, size_t len);
+/* Emits a frame from spi_format_data, returning its read-back data like spi_emit_data */
+extern void *spi_emit_formatted_data(struct spi_port *, const void *frame, size_t framesz);
+
 static inline
 bool spi_txrx(struct spi_port *port)
 {
@@ -89,6 +96,8 @@ bool spi_txrx(struct spi_port *port)
 }
 
 extern int spi_open(struct spi_port *, const char *);
+// Closes any device the port holds open
+extern void spi_close(struct spi_port *);
 extern bool sys_spi_txrx(struct spi_port *);
 extern bool linux_spi_txrx(struct spi_port *);
 extern bool linux_spi_txrx2(struct spi_port *);
@@ -1248,6 +1248,48 @@ ssize_t _serial_read(int fd, char *buf, size_t bufsiz, char *eol)
 	return tlen;
 }
 
+// How much to ask for at once when looking for the end of a line
+#define SERIAL_READAHEAD_SZ  0x400
+
+/* Like _serial_read, but reads lines in large chunks, keeping any data past
+ * the end of the line in readahead for the next call. The same readahead must
+ * be used for all reads from fd, and reset when it is reopened. */
+ssize_t _serial_read_buffered(const int fd, bytes_t * const readahead, void * const buf, const size_t bufsiz, const char * const eol)
+{
+	ssize_t len, found;
+	size_t outsz;
+	
+	while (true)
+	{
+		if (eol && (found = bytes_find(readahead, *eol)) != -1)
+		{
+			outsz = found + 1;
+			break;
+		}
+		if (bytes_len(readahead) >= bufsiz)
+		{
+			outsz = bufsiz;
+			break;
+		}
+		// Without an EOL, never read past what was asked for
+		const size_t readsz = eol ? SERIAL_READAHEAD_SZ : (bufsiz - bytes_len(readahead));
+		len = read(fd, bytes_preappend(readahead, readsz), readsz);
+		if (len < 1)
+		{
+			if (!bytes_len(readahead))
+				return len;
+			outsz = bytes_len(readahead);
+			break;
+		}
+		bytes_postappend(readahead, len);
+	}
+	if (outsz > bufsiz)
+		outsz = bufsiz;
+	memcpy(buf, bytes_buf(readahead), outsz);
+	bytes_shift(readahead, outsz);
+	return outsz;
+}
+
 #ifndef WIN32
 
 enum bfg_gpio_value get_serial_cts(int fd)
@@ -37,6 +37,11 @@ extern ssize_t _serial_read(int fd, char *buf, size_t buflen, char *eol);
 	_serial_read(fd, (char*)(buf), count, NULL)
 #define serial_read_line(fd, buf, bufsiz, eol)  \
 	_serial_read(fd, buf, bufsiz, &eol)
+extern ssize_t _serial_read_buffered(int fd, bytes_t *readahead, void *buf, size_t bufsiz, const char *eol);
+#define serial_read_buffered(fd, readahead, buf, count)  \
+	_serial_read_buffered(fd, readahead, buf, count, NULL)
+#define serial_read_line_buffered(fd, readahead, buf, bufsiz, eol)  \
+	_serial_read_buffered(fd, readahead, buf, bufsiz, &(const char){eol})
 extern int serial_close(int fd);
 
 // NOTE: timeout_ms=0 means it never times out
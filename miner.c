@@ -90,6 +90,10 @@
 #include "lowlevel.h"
 #endif
 
+#if (defined(USE_ICARUS) || defined(USE_BITFORCE)) && !defined(WIN32)
+#include "simulator.h"
+#endif
+
 #if defined(unix) || defined(__APPLE__)
 	#include <errno.h>
 	#include <fcntl.h>
@@ -118,6 +122,7 @@ struct strategies strategies[] = {
 	{ "Rotate" },
 	{ "Load Balance" },
 	{ "Balance" },
+	{ "Latency Balance" },
 };
 
 #define packagename bfgminer_name_space_ver
@@ -157,6 +162,11 @@ static int opt_retries = -1;
 int opt_fail_pause = 5;
 int opt_log_interval = 20;
 int opt_queue = 1;
+static int opt_work_gen_threads;
+// Works being generated by work_gen threads, not yet staged (protected by stgd_lock)
+static int work_gen_pending;
+// Pool chosen by main for work_gen threads to generate from (protected by stgd_lock)
+static struct pool *work_gen_pool;
 int opt_scantime = 60;
 int opt_expiry = 120;
 int opt_expiry_lp = 3600;
@@ -231,6 +241,7 @@ char *opt_api_groups;
 char *opt_api_description = PACKAGE_STRING;
 int opt_api_port = 4028;
 bool opt_api_listen;
+bool opt_api_keepalive;
 bool opt_api_mcast;
 char *opt_api_mcast_addr = API_MCAST_ADDR;
 char *opt_api_mcast_code = API_MCAST_CODE;
@@ -381,6 +392,7 @@ struct stratum_share {
 	bool block;
 	struct work *work;
 	int id;
+	struct timeval tv_submit;
 };
 
 static struct stratum_share *stratum_shares = NULL;
@@ -1004,6 +1016,9 @@ static void switch_logsize(void);
 #endif
 
 static void hotplug_trigger();
+#ifdef HAVE_BFG_LOWLEVEL
+static void probe_cache_flush_unclaimed();
+#endif
 
 void goal_set_malgo(struct mining_goal_info * const goal, struct mining_algorithm * const malgo)
 {
@@ -1016,7 +1031,12 @@ void goal_set_malgo(struct mining_goal_info * const goal, struct mining_algorith
 		// First time using a new mining algorithm may means we need to add mining hardware to support it
 		// api_thr_id is used as an ugly hack to determine if mining has started - if not, we do NOT want to try to hotplug anything (let the initial detect handle it)
 		if (opt_hotplug && api_thr_id)
+		{
+#ifdef HAVE_BFG_LOWLEVEL
+			probe_cache_flush_unclaimed();
+#endif
 			hotplug_trigger();
+		}
 	goal->malgo = malgo;
 }
 
@@ -1617,6 +1637,12 @@ static char *set_balance(enum pool_strategy *strategy)
 	return NULL;
 }
 
+static char *set_latencybalance(enum pool_strategy *strategy)
+{
+	*strategy = POOL_LATENCYBALANCE;
+	return NULL;
+}
+
 static char *set_loadbalance(enum pool_strategy *strategy)
 {
 	*strategy = POOL_LOADBALANCE;
@@ -2313,6 +2339,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--api-groups",
 		     set_api_groups, NULL, NULL,
 		     "API one letter groups G:cmd:cmd[,P:cmd:*...] defining the cmds a groups can use"),
+	OPT_WITHOUT_ARG("--api-keepalive",
+			opt_set_bool, &opt_api_keepalive,
+			"Keep API connections open for multiple newline-terminated requests, default: one request per connection"),
 	OPT_WITHOUT_ARG("--api-listen",
 			opt_set_bool, &opt_api_listen,
 			"Enable API, default: disabled"),
@@ -2387,6 +2416,9 @@ static struct opt_table opt_config_table[] = {
 			"Use compact display without per device statistics"),
 #endif
 #ifdef USE_CPUMINING
+	OPT_WITH_ARG("--cpu-affinity",
+		     set_cpu_affinity, NULL, &opt_cpu_affinity,
+		     "CPU mining thread placement: auto, none, core (one per physical core), smt (one per hardware thread)"),
 	OPT_WITH_ARG("--cpu-threads",
 		     force_nthreads_int, opt_show_intval, &opt_n_threads,
 		     "Number of miner CPU threads"),
@@ -2412,7 +2444,7 @@ static struct opt_table opt_config_table[] = {
 #ifdef USE_LIBMICROHTTPD
 	OPT_WITH_ARG("--http-port",
 	             opt_set_intval, opt_show_intval, &httpsrv_port,
-	             "Port number to listen on for HTTP getwork miners (-1 means disabled)"),
+	             "Port number to listen on for HTTP getwork miners and Prometheus /metrics scrapes (-1 means disabled)"),
 #endif
 	OPT_WITH_ARG("--expiry",
 		     set_int_0_to_9999, opt_show_intval, &opt_expiry,
@@ -2518,6 +2550,9 @@ static struct opt_table opt_config_table[] = {
 		     set_klondike_options, NULL, NULL,
 		     "Set klondike options clock:temptarget"),
 #endif
+	OPT_WITHOUT_ARG("--latency-balance",
+		     set_latencybalance, &pool_strategy,
+		     "Change multipool strategy from failover to balance by each pool's accepted share rate and latency"),
 	OPT_WITHOUT_ARG("--load-balance",
 		     set_loadbalance, &pool_strategy,
 		     "Change multipool strategy from failover to quota based balance"),
@@ -2724,6 +2759,11 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--show-procs",
 			opt_set_bool, &opt_show_procs,
 			opt_hidden),
+#if (defined(USE_ICARUS) || defined(USE_BITFORCE)) && !defined(WIN32)
+	OPT_WITH_ARG("--simulate",
+	             bfg_simulator_add, NULL, NULL,
+	             "Simulate devices on pseudo terminals: <protocol>:<count>[:<latency ms>[:<error %>[:<hashes/s>]]] " BFG_SIM_PROTOCOLS_HELP),
+#endif
 	OPT_WITH_ARG("--skip-security-checks",
 			set_int_0_to_9999, NULL, &opt_skip_checks,
 			"Skip security checks sometimes to save bandwidth; only check 1/<arg>th of the time (default: never skip)"),
@@ -2798,6 +2838,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--weighed-stats",
 	                opt_set_bool, &opt_weighed_stats,
 	                "Display statistics weighed to difficulty 1"),
+	OPT_WITH_ARG("--work-gen-threads",
+	             set_int_0_to_9999, opt_show_intval, &opt_work_gen_threads,
+	             "Number of extra threads generating stratum and GBT work in batches (0 to generate it only in the main thread)"),
 #ifdef USE_OPENCL
 	OPT_WITH_ARG("--worksize|-w",
 	             set_worksize, NULL, NULL,
@@ -3682,6 +3725,7 @@ static bool work_decode(struct pool *pool, struct work *work, json_t *val)
 			// FIXME: Do something with expire
 			pool->nonce2sz = swork->n2size = GBT_XNONCESZ;
 			pool->nonce2 = 0;
+			++swork->generation;
 			cg_wunlock(&pool->data_lock);
 		}
 		else
@@ -4723,7 +4767,7 @@ static void curses_print_status(const int ts)
 	bfg_waddstr(statuswin, "[H]elp [Q]uit ");
 	wattroff(statuswin, menu_attr);
 
-	if ((pool_strategy == POOL_LOADBALANCE  || pool_strategy == POOL_BALANCE) && enabled_pools > 1) {
+	if ((pool_strategy == POOL_LOADBALANCE  || pool_strategy == POOL_BALANCE || pool_strategy == POOL_LATENCYBALANCE) && enabled_pools > 1) {
 		char poolinfo[20], poolinfo2[20];
 		int poolinfooff = 0, poolinfo2off, workable_pools = 0;
 		double lowdiff = DBL_MAX, highdiff = -1;
@@ -5223,6 +5267,36 @@ int put_in_parens(char * const buf, const size_t bufsz, const char * const s)
 	return p + 1;
 }
 
+const double pool_submit_latency_bounds[POOL_SUBMIT_LATENCY_BUCKETS] = {
+	.05, .1, .25, .5, 1, 2.5, 5, 10,
+};
+
+// Like share_result, this is not locked since submits rarely complete at the same time
+void pool_record_submit_latency(struct pool * const pool, const double secs)
+{
+	struct cgminer_pool_stats * const pool_stats = &pool->cgminer_pool_stats;
+	int i;
+	
+	for (i = 0; i < POOL_SUBMIT_LATENCY_BUCKETS; ++i)
+		if (secs <= pool_submit_latency_bounds[i])
+			break;
+	++pool_stats->submit_latency_hist[i];
+	++pool_stats->submit_latency_count;
+	pool_stats->submit_latency_sum += secs;
+	
+	if (pool->lb_submit_rtt)
+		pool->lb_submit_rtt = (pool->lb_submit_rtt + secs * 0.63) / 1.63;
+	else
+		pool->lb_submit_rtt = secs;
+}
+
+// Tracks the rolling fraction of a pool's shares that were wasted (rejected or stale)
+static
+void pool_record_share_outcome(struct pool * const pool, const bool wasted)
+{
+	pool->lb_reject_ratio = (pool->lb_reject_ratio + (wasted ? 0.63 : 0)) / 1.63;
+}
+
 /* Theoretically threads could race when modifying accepted and
  * rejected values but the chance of two submits completing at the
  * same time is zero so there is no point adding extra locking */
@@ -5248,6 +5322,7 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 		goal->diff_accepted += work->work_difficulty;
 		mutex_unlock(&stats_lock);
 
+		pool_record_share_outcome(pool, false);
 		pool->seq_rejects = 0;
 		cgpu->last_share_pool = pool->pool_no;
 		cgpu->last_share_pool_time = time(NULL);
@@ -5255,6 +5330,7 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 		pool->last_share_time = cgpu->last_share_pool_time;
 		pool->last_share_diff = work->work_difficulty;
 		applog(LOG_DEBUG, "PROOF OF WORK RESULT: true (yay!!!)");
+		api_event_share(cgpu, work, "accepted");
 		if (!QUIET) {
 			share_result_msg(work, "Accepted", "", resubmit, worktime);
 		}
@@ -5318,8 +5394,10 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 		pool->diff_rejected += work->work_difficulty;
 		pool->seq_rejects++;
 		mutex_unlock(&stats_lock);
+		pool_record_share_outcome(pool, true);
 
 		applog(LOG_DEBUG, "PROOF OF WORK RESULT: false (booooo)");
+		api_event_share(cgpu, work, "rejected");
 		if (!QUIET) {
 			char disposition[36] = "reject";
 			char reason[32];
@@ -5430,6 +5508,7 @@ static bool submit_upstream_work_completed(struct work *work, bool resubmit, str
 	} else if (pool_tclear(pool, &pool->submit_fail))
 		applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
 
+	pool_record_submit_latency(pool, tdiff(&tv_submit_reply, ptv_submit));
 	res = json_object_get(val, "result");
 	err = json_object_get(val, "error");
 
@@ -5524,7 +5603,7 @@ bool pool_actively_desired(const struct pool * const pool, const struct pool *cp
 		return false;
 	if (pool_strategy == POOL_LOADBALANCE && pool->quota)
 		return true;
-	if (pool_strategy == POOL_BALANCE && !pool->failover_only)
+	if ((pool_strategy == POOL_BALANCE || pool_strategy == POOL_LATENCYBALANCE) && !pool->failover_only)
 		return true;
 	if (!cp)
 		cp = current_pool();
@@ -5569,6 +5648,9 @@ static struct pool *_select_longpoll_pool(struct pool *, bool(*)(struct pool *))
 #define select_longpoll_pool(pool)  _select_longpoll_pool(pool, pool_supports_block_change_notification)
 #define pool_active_lp_pool(pool)  _select_longpoll_pool(pool, pool_has_active_block_change_notification)
 
+// Protects pool selection state (quota_used, shares, lb_pass and the strategies' statics)
+static pthread_mutex_t pool_select_lock;
+
 /* In balanced mode, the amount of diff1 solutions per pool is monitored as a
  * rolling average per 10 minutes and if pools start getting more, it biases
  * away from them to distribute work evenly. The share count is reset to the
@@ -5609,6 +5691,61 @@ struct pool *select_balanced(struct pool *cp, struct mining_algorithm * const ma
 	return ret;
 }
 
+// Lowest share of work a pool gets, so it can still show whether it improved
+#define LATENCY_BALANCE_MIN_WEIGHT  0.01
+
+/* Relative amount of work a pool should get: the fraction of its shares that
+ * are accepted, reduced by how long we wait on it for submits (or to connect)
+ * and new work */
+static
+double pool_latency_weight(const struct pool * const pool)
+{
+	// Until shares have been submitted, the probe's connect time is the best estimate
+	double latency = pool->lb_submit_rtt ?: pool->probe_rtt, weight;
+	
+	if (!pool->has_stratum)
+		latency += pool->cgminer_pool_stats.getwork_wait_rolling;
+	weight = (1. - pool->lb_reject_ratio) / (1. + latency);
+	if (weight < LATENCY_BALANCE_MIN_WEIGHT)
+		weight = LATENCY_BALANCE_MIN_WEIGHT;
+	return weight;
+}
+
+/* Hands out work in proportion to each pool's weight, by giving each work to
+ * the pool whose pass is lowest and advancing it by the inverse of its weight */
+static
+struct pool *select_latency_balanced(struct mining_algorithm * const malgo)
+{
+	static double last_pass;
+	struct pool *ret = NULL, *failover_pool = NULL;
+	
+	for (int i = 0; i < total_pools; ++i)
+	{
+		struct pool * const pool = pools[i];
+		
+		if (malgo && pool->goal->malgo != malgo)
+			continue;
+		if (pool_unworkable(pool))
+			continue;
+		if (pool->failover_only)
+		{
+			BFGINIT(failover_pool, pool);
+			continue;
+		}
+		// Pools coming back don't get to catch up on work they missed
+		if (pool->lb_pass < last_pass)
+			pool->lb_pass = last_pass;
+		if ((!ret) || pool->lb_pass < ret->lb_pass)
+			ret = pool;
+	}
+	if (!ret)
+		return failover_pool;
+	
+	last_pass = ret->lb_pass;
+	ret->lb_pass += 1. / pool_latency_weight(ret);
+	return ret;
+}
+
 static
 struct pool *select_loadbalance(struct mining_algorithm * const malgo)
 {
@@ -5717,7 +5854,18 @@ retry:
 	cp = current_pool();
 
 	if (pool_strategy == POOL_BALANCE) {
+		mutex_lock(&pool_select_lock);
 		pool = select_balanced(cp, malgo);
+		mutex_unlock(&pool_select_lock);
+		if ((!pool) || pool_unworkable(pool))
+			goto simple_failover;
+		goto out;
+	}
+
+	if (pool_strategy == POOL_LATENCYBALANCE) {
+		mutex_lock(&pool_select_lock);
+		pool = select_latency_balanced(malgo);
+		mutex_unlock(&pool_select_lock);
 		if ((!pool) || pool_unworkable(pool))
 			goto simple_failover;
 		goto out;
@@ -5729,7 +5877,11 @@ retry:
 		pool = cp;
 		goto out;
 	} else
+	{
+		mutex_lock(&pool_select_lock);
 		pool = select_loadbalance(malgo);
+		mutex_unlock(&pool_select_lock);
+	}
 
 simple_failover:
 	/* If there are no alive pools with quota, choose according to
@@ -5834,6 +5986,7 @@ void *benchmark_intense_work_update_thread(void *userp)
 		for (int i = 36; --i >= 0; )
 			if (++blkhdr[i])
 				break;
+		++swork->generation;
 		cg_wunlock(&pool->data_lock);
 		
 		struct work *work = make_work();
@@ -6140,6 +6293,19 @@ tryagain:
 		pool_stats->getwork_wait_min.tv_usec = tv_elapsed.tv_usec;
 	}
 	pool_stats->getwork_calls++;
+	
+	if (rc && work->tr)
+	{
+		const blktemplate_t * const tmpl = work->tr->tmpl;
+		uint64_t txnbytes = 0;
+		for (unsigned long i = 0; i < tmpl->txncount; ++i)
+			txnbytes += tmpl->txns[i].datasz;
+		pool_stats->template_txns = tmpl->txncount;
+		pool_stats->template_bytes = txnbytes;
+		pool_stats->template_fetch_time = tdiff(&work->tv_getwork_reply, &work->tv_getwork);
+		applog(LOG_DEBUG, "Pool %u: GBT template with %lu transactions (%"PRIu64" bytes) fetched in %.3fs",
+		       pool->pool_no, tmpl->txncount, txnbytes, pool_stats->template_fetch_time);
+	}
 
 	work->pool = pool;
 	work->longpoll = false;
@@ -6453,13 +6619,15 @@ static void roll_work(struct work *work)
 		applog(LOG_DEBUG, "Successfully rolled time header in work");
 	}
 
-	local_work++;
 	work->rolls++;
 	work->blk.nonce = 0;
 
 	/* This is now a different work item so it needs a different ID for the
 	 * hashtable */
+	cg_wlock(&control_lock);
+	local_work++;
 	work->id = total_work++;
+	cg_wunlock(&control_lock);
 }
 
 /* Duplicates any dynamically allocated arrays within the work struct to
@@ -6592,6 +6760,10 @@ bool stale_work(struct work *work, bool share)
 	/* Technically the rolltime should be correct but some pools
 	 * advertise a broken expire= that is lower than a meaningful
 	 * scantime */
+	if (work->tr && work->stratum)
+		// Made locally from the template's merkle data, so good until it expires
+		work_expiry = blkmk_time_left(work->tr->tmpl, work->tv_staged.tv_sec);
+	else
 	if (work->rolltime >= opt_scantime || work->tr)
 		work_expiry = work->rolltime;
 	else
@@ -6648,12 +6820,14 @@ bool stale_work(struct work *work, bool share)
 			return true;
 		}
 
-		same_job = true;
-
-		cg_rlock(&pool->data_lock);
-		if (strcmp(work->job_id, pool->swork.job_id))
-			same_job = false;
-		cg_runlock(&pool->data_lock);
+		// Job contents only change with the generation, so this usually avoids the lock
+		same_job = (work->swork_generation == pool->swork.generation);
+		if (!same_job)
+		{
+			cg_rlock(&pool->data_lock);
+			same_job = !strcmp(work->job_id, pool->swork.job_id);
+			cg_runlock(&pool->data_lock);
+		}
 
 		if (!same_job) {
 			applog(LOG_DEBUG, "Work stale due to stratum job_id mismatch");
@@ -6737,6 +6911,7 @@ static void submit_discard_share2(const char *reason, struct work *work)
 	++total_stale;
 	++cgpu->stale;
 	++(work->pool->stale_shares);
+	pool_record_share_outcome(work->pool, true);
 	total_diff_stale += work->work_difficulty;
 	cgpu->diff_stale += work->work_difficulty;
 	work->pool->diff_stale += work->work_difficulty;
@@ -7037,6 +7212,7 @@ next_write_sws_del:
 			
 			applog(LOG_DEBUG, "DBG: sending %s submit RPC call: %s", pool->stratum_url, s);
 
+			cgtime(&sshare->tv_submit);
 			if (likely(stratum_send(pool, s, strlen(s)))) {
 				if (pool_tclear(pool, &pool->submit_fail))
 					applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
@@ -7266,6 +7442,7 @@ void switch_pools(struct pool *selected)
 	switch (pool_strategy) {
 		/* All of these set to the master pool */
 		case POOL_BALANCE:
+		case POOL_LATENCYBALANCE:
 		case POOL_FAILOVER:
 		case POOL_LOADBALANCE:
 			for (i = 0; i < total_pools; i++) {
@@ -7323,8 +7500,9 @@ void switch_pools(struct pool *selected)
 	if (pool != last_pool)
 	{
 		pool->block_id = 0;
-		if (pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE) {
+		if (pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE && pool_strategy != POOL_LATENCYBALANCE) {
 			applog(LOG_WARNING, "Switching to pool %d %s", pool->pool_no, pool->rpc_url);
+			api_event_pool_switch(pool);
 			if (pool_localgen(pool) || opt_fail_only)
 				clear_pool_work(last_pool);
 		}
@@ -7371,7 +7549,7 @@ void unstage_work(struct work * const work)
 static void wake_gws(void)
 {
 	mutex_lock(stgd_lock);
-	pthread_cond_signal(&gws_cond);
+	pthread_cond_broadcast(&gws_cond);
 	mutex_unlock(stgd_lock);
 }
 
@@ -7388,7 +7566,7 @@ static void discard_stale(void)
 			stale++;
 		}
 	}
-	pthread_cond_signal(&gws_cond);
+	pthread_cond_broadcast(&gws_cond);
 	mutex_unlock(stgd_lock);
 
 	if (stale)
@@ -7465,8 +7643,10 @@ void set_curblock(struct mining_goal_info * const goal, struct block_info * cons
 {
 	struct blockchain_info * const blkchain = goal->blkchain;
 
+	wr_lock(&blk_lock);
 	blkchain->currentblk = blkinfo;
 	blkchain->currentblk_subsidy = 5000000000LL >> (blkinfo->height / 210000);
+	wr_unlock(&blk_lock);
 
 	cg_wlock(&ch_lock);
 	__update_block_title(goal);
@@ -7474,6 +7654,7 @@ void set_curblock(struct mining_goal_info * const goal, struct block_info * cons
 	cg_wunlock(&ch_lock);
 
 	applog(LOG_INFO, "New block: %s diff %s (%s)", goal->current_goal_detail, goal->current_diff_str, goal->net_hashrate);
+	api_event_block(goal, blkinfo);
 }
 
 /* Search to see if this prevblkhash has been seen before */
@@ -7670,28 +7851,37 @@ static bool work_rollable(struct work *work)
 	return (!work->clone && work->rolltime);
 }
 
-static bool hash_push(struct work *work)
+// NOTE: Caller must hold stgd_lock, and sort staged_work afterward
+static bool __hash_push(struct work *work)
 {
-	bool rc = true;
-
-	mutex_lock(stgd_lock);
+	// Counted here, under stgd_lock, since work_gen threads stage concurrently
+	work->pool->works++;
 	if (work_rollable(work))
 		staged_rollable++;
 	++work_mining_algorithm(work)->staged;
 	if (work->spare)
 		++staged_spare;
-	if (likely(!getq->frozen)) {
-		HASH_ADD_INT(staged_work, id, work);
+	if (unlikely(getq->frozen))
+		return false;
+	HASH_ADD_INT(staged_work, id, work);
+	return true;
+}
+
+static bool hash_push(struct work *work)
+{
+	bool rc;
+
+	mutex_lock(stgd_lock);
+	rc = __hash_push(work);
+	if (rc)
 		HASH_SORT(staged_work, tv_sort);
-	} else
-		rc = false;
 	pthread_cond_broadcast(&getq->cond);
 	mutex_unlock(stgd_lock);
 
 	return rc;
 }
 
-static void stage_work(struct work *work)
+static void stage_work_prepare(struct work *work)
 {
 	applog(LOG_DEBUG, "Pushing work %d from pool %d to hash queue",
 	       work->id, work->pool->pool_no);
@@ -7699,10 +7889,33 @@ static void stage_work(struct work *work)
 	work->pool->last_work_time = time(NULL);
 	cgtime(&work->pool->tv_last_work_time);
 	test_work_current(work);
-	work->pool->works++;
+}
+
+static void stage_work(struct work *work)
+{
+	stage_work_prepare(work);
 	hash_push(work);
 }
 
+// Stages several works at once, sorting the staged queue only once
+static void stage_works(struct work ** const works, const int count)
+{
+	int i;
+	bool added = false;
+	
+	for (i = 0; i < count; ++i)
+		stage_work_prepare(works[i]);
+	
+	mutex_lock(stgd_lock);
+	for (i = 0; i < count; ++i)
+		if (__hash_push(works[i]))
+			added = true;
+	if (added)
+		HASH_SORT(staged_work, tv_sort);
+	pthread_cond_broadcast(&getq->cond);
+	mutex_unlock(stgd_lock);
+}
+
 #ifdef HAVE_CURSES
 int curses_int(const char *query)
 {
@@ -7935,6 +8148,8 @@ void write_config(FILE *fcfg)
 	fprintf(fcfg, ",\n\"shares\" : %g", opt_shares);
 	if (pool_strategy == POOL_BALANCE)
 		fputs(",\n\"balance\" : true", fcfg);
+	if (pool_strategy == POOL_LATENCYBALANCE)
+		fputs(",\n\"latency-balance\" : true", fcfg);
 	if (pool_strategy == POOL_LOADBALANCE)
 		fputs(",\n\"load-balance\" : true", fcfg);
 	if (pool_strategy == POOL_ROUNDROBIN)
@@ -8078,6 +8293,9 @@ void zero_stats(void)
 		pool->cgminer_pool_stats.times_received = 0;
 		pool->cgminer_pool_stats.bytes_received = 0;
 		pool->cgminer_pool_stats.net_bytes_received = 0;
+		memset(pool->cgminer_pool_stats.submit_latency_hist, 0, sizeof(pool->cgminer_pool_stats.submit_latency_hist));
+		pool->cgminer_pool_stats.submit_latency_count = 0;
+		pool->cgminer_pool_stats.submit_latency_sum = 0;
 	}
 
 	zero_bestshare();
@@ -9218,6 +9436,7 @@ out_unlock:
 			fflush(stdout);
 		} else
 			applog(LOG_INFO, "%s", logstatusline);
+		api_event_devices();
 	}
 }
 
@@ -9242,7 +9461,10 @@ static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
 				 struct stratum_share *sshare)
 {
 	struct work *work = sshare->work;
+	struct timeval tv_now;
 
+	cgtime(&tv_now);
+	pool_record_submit_latency(work->pool, tdiff(&tv_now, &sshare->tv_submit));
 	share_result(val, res_val, err_val, work, false, "");
 }
 
@@ -10025,9 +10247,11 @@ void *cmd_idle_thread(void * const __maybe_unused userp)
 	return NULL;
 }
 
-static struct work *hash_pop(struct cgpu_info * const proc)
+// Pops up to max usable works, blocking only until the first is available
+// Beyond the first, only takes works staged above the --queue minimum, leaving the rest for other devices
+static int hash_pop_batch(struct cgpu_info * const proc, struct work ** const works, const int max)
 {
-	int hc;
+	int hc, count = 0;
 	struct work *work, *work_found, *tmp;
 	enum {
 		HPWS_NONE,
@@ -10041,6 +10265,7 @@ static struct work *hash_pop(struct cgpu_info * const proc)
 
 retry:
 	mutex_lock(stgd_lock);
+next:
 	while (true)
 	{
 		work_found = NULL;
@@ -10081,6 +10306,10 @@ retry:
 			break;
 		}
 		
+		// Don't wait for more once we have something
+		if (count)
+			goto out;
+		
 		// Failed to get a usable work
 		if (unlikely(staged_full))
 		{
@@ -10094,7 +10323,7 @@ retry:
 			staged_full = false;  // Let it fill up before triggering an underrun again
 			no_work = true;
 		}
-		pthread_cond_signal(&gws_cond);
+		pthread_cond_broadcast(&gws_cond);
 		
 		if (cmd_idle && !did_cmd_idle)
 		{
@@ -10104,12 +10333,18 @@ retry:
 		pthread_cond_wait(&getq->cond, stgd_lock);
 	}
 	if (did_cmd_idle)
+	{
 		pthread_cancel(cmd_idle_thr);
+		did_cmd_idle = false;
+	}
 	
 	no_work = false;
 
 	if (can_roll(work) && should_roll(work))
 	{
+		// Rather than waiting on a clone, return what we already have
+		if (count)
+			goto out;
 		// Instead of consuming it, force it to be cloned and grab the clone
 		mutex_unlock(stgd_lock);
 		clone_available();
@@ -10117,16 +10352,27 @@ retry:
 	}
 	
 	unstage_work(work);
+	work->pool->last_work_time = time(NULL);
+	cgtime(&work->pool->tv_last_work_time);
+	works[count++] = work;
+	if (count < max && HASH_COUNT(staged_work) > opt_queue)
+		goto next;
 
+out:
 	/* Signal the getwork scheduler to look for more work */
-	pthread_cond_signal(&gws_cond);
+	pthread_cond_broadcast(&gws_cond);
 
 	/* Signal hash_pop again in case there are mutliple hash_pop waiters */
 	pthread_cond_signal(&getq->cond);
 	mutex_unlock(stgd_lock);
-	work->pool->last_work_time = time(NULL);
-	cgtime(&work->pool->tv_last_work_time);
 
+	return count;
+}
+
+static struct work *hash_pop(struct cgpu_info * const proc)
+{
+	struct work *work;
+	hash_pop_batch(proc, &work, 1);
 	return work;
 }
 
@@ -10407,15 +10653,19 @@ void gen_stratum_work3(struct work * const work, struct stratum_work * const swo
 	memcpy(work->target, swork->target, sizeof(work->target));
 	work->job_id = maybe_strdup(swork->job_id);
 	work->nonce1 = maybe_strdup(swork->nonce1);
+	work->swork_generation = swork->generation;
 	if (data_lock_p)
 		cg_runlock(data_lock_p);
 
 	calc_midstate(work);
 
+	// work_gen and device threads generate work concurrently
+	cg_wlock(&control_lock);
 	local_work++;
+	work->id = total_work++;
+	cg_wunlock(&control_lock);
 	work->stratum = true;
 	work->blk.nonce = 0;
-	work->id = total_work++;
 	work->longpoll = false;
 	work->getwork_mode = GETWORK_MODE_STRATUM;
 	if (swork->tr) {
@@ -10426,6 +10676,111 @@ void gen_stratum_work3(struct work * const work, struct stratum_work * const swo
 	calc_diff(work, 0);
 }
 
+// Number of nonce2 values a local work generator reserves from its pool at once
+#define LOCAL_WORK_NONCE2_BLOCK  0x100
+
+static
+bool local_work_gen_reserve(struct local_work_gen * const gen, struct pool * const pool)
+{
+	// NOTE: Caller must hold data_lock for writing
+	if (pool->nonce2sz < (int)sizeof(pool->nonce2) && pool->nonce2 + LOCAL_WORK_NONCE2_BLOCK > (1ULL << (pool->nonce2sz * 8)))
+		return false;
+	gen->nonce2 = pool->nonce2;
+	pool->nonce2 += LOCAL_WORK_NONCE2_BLOCK;
+	gen->nonce2_end = pool->nonce2;
+	return true;
+}
+
+/* Takes a private copy of the job work was made from, so further work for it
+ * can be generated by local_work_gen_next without going through the pool */
+bool local_work_gen_init(struct local_work_gen * const gen, const struct work * const work)
+{
+	struct pool * const pool = work->pool;
+	bool rv = false;
+	
+	local_work_gen_clean(gen);
+	if (!(work->stratum && pool))
+		return false;
+	
+	cg_wlock(&pool->data_lock);
+	// Only if the work is still from the current job
+	if (work->work_restart_id == pool->swork.work_restart_id && work->swork_generation == pool->swork.generation && local_work_gen_reserve(gen, pool))
+	{
+		stratum_work_cpy(&gen->swork, &pool->swork);
+		gen->nonce2sz = pool->nonce2sz;
+		gen->nonce2off = pool->nonce2off;
+		rv = true;
+	}
+	cg_wunlock(&pool->data_lock);
+	
+	if (rv)
+	{
+		gen->pool = pool;
+		gen->nonce_diff = work->nonce_diff;
+	}
+	return rv;
+}
+
+struct work *local_work_gen_next(struct local_work_gen * const gen)
+{
+	struct pool * const pool = gen->pool;
+	struct work *work;
+	
+	if (!pool)
+		return NULL;
+	// Racy reads are fine here: a stale copy is caught again by stale_work
+	if (gen->swork.generation != pool->swork.generation || gen->swork.work_restart_id != pool->swork.work_restart_id || !pool_actively_in_use(pool, NULL))
+		goto drop;
+	
+	if (gen->nonce2 >= gen->nonce2_end)
+	{
+		bool ok;
+		cg_wlock(&pool->data_lock);
+		ok = (gen->swork.generation == pool->swork.generation && local_work_gen_reserve(gen, pool));
+		cg_wunlock(&pool->data_lock);
+		if (!ok)
+			goto drop;
+	}
+	
+	// NOTE: Not using make_work, since gen_stratum_work3 assigns the id under control_lock
+	work = calloc(1, sizeof(*work));
+	if (unlikely(!work))
+		quithere(1, "Failed to calloc work");
+	
+	const int n2size = gen->swork.n2size;
+	bytes_resize(&work->nonce2, n2size);
+	if (gen->nonce2sz < n2size)
+		memset(&bytes_buf(&work->nonce2)[gen->nonce2sz], 0, n2size - gen->nonce2sz);
+	memcpy(bytes_buf(&work->nonce2),
+#ifdef WORDS_BIGENDIAN
+	       &((char*)&gen->nonce2)[gen->nonce2off],
+#else
+	       &gen->nonce2,
+#endif
+	       gen->nonce2sz);
+	++gen->nonce2;
+	
+	work->pool = pool;
+	work->work_restart_id = gen->swork.work_restart_id;
+	gen_stratum_work2(work, &gen->swork);
+	work->nonce_diff = gen->nonce_diff;
+	work->mined = true;
+	cgtime(&work->tv_staged);
+	return work;
+
+drop:
+	local_work_gen_clean(gen);
+	return NULL;
+}
+
+void local_work_gen_clean(struct local_work_gen * const gen)
+{
+	if (!gen->pool)
+		return;
+	stratum_work_clean(&gen->swork);
+	gen->pool = NULL;
+}
+
 void request_work(struct thr_info *thr)
 {
 	struct cgpu_info *cgpu = thr->cgpu;
@@ -10447,30 +10802,36 @@ void request_work(struct thr_info *thr)
 }
 
 // FIXME: Make this non-blocking (and remove HACK above)
-struct work *get_work(struct thr_info *thr)
+// Gets up to max works with a single trip to the staged queue, blocking only for the first
+int get_work_batch(struct thr_info * const thr, struct work ** const works, const int max)
 {
 	const int thr_id = thr->id;
 	struct cgpu_info *cgpu = thr->cgpu;
 	struct cgminer_stats *dev_stats = &(cgpu->cgminer_stats);
 	struct cgminer_stats *pool_stats;
 	struct timeval tv_get;
-	struct work *work = NULL;
+	struct work *work;
+	int count = 0;
 
-	applog(LOG_DEBUG, "%"PRIpreprv": Popping work from get queue to get work", cgpu->proc_repr);
-	while (!work) {
-		work = hash_pop(cgpu);
-		if (stale_work(work, false)) {
-			staged_full = false;  // It wasn't really full, since it was stale :(
-			discard_work(work);
-			work = NULL;
-			wake_gws();
+	applog(LOG_DEBUG, "%"PRIpreprv": Popping up to %d work from get queue to get work", cgpu->proc_repr, max);
+	while (!count) {
+		const int popped = hash_pop_batch(cgpu, works, max);
+		for (int i = 0; i < popped; ++i)
+		{
+			work = works[i];
+			if (stale_work(work, false)) {
+				staged_full = false;  // It wasn't really full, since it was stale :(
+				discard_work(work);
+				wake_gws();
+			}
+			else
+				works[count++] = work;
 		}
 	}
 	last_getwork = time(NULL);
-	applog(LOG_DEBUG, "%"PRIpreprv": Got work %d from get queue to get work for thread %d",
-	       cgpu->proc_repr, work->id, thr_id);
+	applog(LOG_DEBUG, "%"PRIpreprv": Got work %d (%d total) from get queue to get work for thread %d",
+	       cgpu->proc_repr, works[0]->id, count, thr_id);
 
-	work->thr_id = thr_id;
 	thread_reportin(thr);
 	
 	// HACK: Since get_work still blocks, reportin all processors dependent on this thread
@@ -10481,9 +10842,6 @@ struct work *get_work(struct thr_info *thr)
 		thread_reportin(proc->thr[0]);
 	}
 	
-	work->mined = true;
-	work->blk.nonce = 0;
-
 	cgtime(&tv_get);
 	timersub(&tv_get, &dev_stats->_get_start, &tv_get);
 
@@ -10494,30 +10852,45 @@ struct work *get_work(struct thr_info *thr)
 		dev_stats->getwork_wait_min = tv_get;
 	++dev_stats->getwork_calls;
 
-	pool_stats = &(work->pool->cgminer_stats);
-	timeradd(&tv_get, &pool_stats->getwork_wait, &pool_stats->getwork_wait);
-	if (timercmp(&tv_get, &pool_stats->getwork_wait_max, >))
-		pool_stats->getwork_wait_max = tv_get;
-	if (timercmp(&tv_get, &pool_stats->getwork_wait_min, <))
-		pool_stats->getwork_wait_min = tv_get;
-	++pool_stats->getwork_calls;
-	
-	if (work->work_difficulty < 1)
+	for (int i = 0; i < count; ++i)
 	{
-		const float min_nonce_diff = drv_min_nonce_diff(cgpu->drv, cgpu, work_mining_algorithm(work));
-		if (unlikely(work->work_difficulty < min_nonce_diff))
+		work = works[i];
+		work->thr_id = thr_id;
+		work->mined = true;
+		work->blk.nonce = 0;
+
+		pool_stats = &(work->pool->cgminer_stats);
+		timeradd(&tv_get, &pool_stats->getwork_wait, &pool_stats->getwork_wait);
+		if (timercmp(&tv_get, &pool_stats->getwork_wait_max, >))
+			pool_stats->getwork_wait_max = tv_get;
+		if (timercmp(&tv_get, &pool_stats->getwork_wait_min, <))
+			pool_stats->getwork_wait_min = tv_get;
+		++pool_stats->getwork_calls;
+		
+		if (work->work_difficulty < 1)
 		{
-			if (min_nonce_diff - work->work_difficulty > 1./0x10000000)
-				applog(LOG_WARNING, "%"PRIpreprv": Using work with lower difficulty than device supports",
-				       cgpu->proc_repr);
-			work->nonce_diff = min_nonce_diff;
+			const float min_nonce_diff = drv_min_nonce_diff(cgpu->drv, cgpu, work_mining_algorithm(work));
+			if (unlikely(work->work_difficulty < min_nonce_diff))
+			{
+				if (min_nonce_diff - work->work_difficulty > 1./0x10000000)
+					applog(LOG_WARNING, "%"PRIpreprv": Using work with lower difficulty than device supports",
+					       cgpu->proc_repr);
+				work->nonce_diff = min_nonce_diff;
+			}
+			else
+				work->nonce_diff = work->work_difficulty;
 		}
 		else
-			work->nonce_diff = work->work_difficulty;
+			work->nonce_diff = 1;
 	}
-	else
-		work->nonce_diff = 1;
 
+	return count;
+}
+
+struct work *get_work(struct thr_info *thr)
+{
+	struct work *work;
+	get_work_batch(thr, &work, 1);
 	return work;
 }
 
@@ -10950,40 +11323,140 @@ int age_queued_work(struct cgpu_info *cgpu, double secs)
 	return aged;
 }
 
-/* This function should be used by queued device drivers when they're sure
- * the work struct is no longer in use. */
-void work_completed(struct cgpu_info *cgpu, struct work *work)
+/* Size must be a power of two, and should be larger than the number of work
+ * items that can be outstanding at once. */
+void work_id_table_init(struct work_id_table * const tbl, const uint32_t size)
 {
-	wr_lock(&cgpu->qlock);
-	__work_completed(cgpu, work);
-	wr_unlock(&cgpu->qlock);
+	*tbl = (struct work_id_table){
+		.entries = calloc(size, sizeof(*tbl->entries)),
+		.mask = size - 1,
+	};
+	if (unlikely(!tbl->entries))
+		quit(1, "Failed to calloc work_id_table");
+}
 
-	free_work(work);
+/* Adds work under id, returning any older work that was displaced from its
+ * slot so the caller can dispose of it. */
+struct work *work_id_table_add(struct work_id_table * const tbl, const uint32_t id, struct work * const work)
+{
+	struct work_id_table_entry * const entry = &tbl->entries[id & tbl->mask];
+	struct work * const old_work = entry->work;
+
+	if (old_work)
+		--tbl->count;
+	else
+	if (!tbl->count)
+		tbl->oldest = id & tbl->mask;
+	*entry = (struct work_id_table_entry){
+		.id = id,
+		.work = work,
+	};
+	++tbl->count;
+	return old_work;
 }
 
-/* Combines find_queued_work_bymidstate and work_completed in one function
- * withOUT destroying the work so the driver must free it. */
-struct work *take_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate, size_t midstatelen, char *data, int offset, size_t datalen)
+struct work *work_id_table_find(struct work_id_table * const tbl, const uint32_t id)
 {
-	struct work *work;
+	struct work_id_table_entry * const entry = &tbl->entries[id & tbl->mask];
 
-	wr_lock(&cgpu->qlock);
-	work = __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
-	if (work)
-		__work_completed(cgpu, work);
-	wr_unlock(&cgpu->qlock);
+	if (entry->work && entry->id == id)
+		return entry->work;
+	return NULL;
+}
+
+/* Removes the work from the table and returns it without freeing it. */
+struct work *work_id_table_take(struct work_id_table * const tbl, const uint32_t id)
+{
+	struct work_id_table_entry * const entry = &tbl->entries[id & tbl->mask];
+	struct work * const work = entry->work;
 
+	if (!(work && entry->id == id))
+		return NULL;
+	entry->work = NULL;
+	--tbl->count;
 	return work;
 }
 
-void flush_queue(struct cgpu_info *cgpu)
+/* Frees work started more than secs seconds ago, walking from the oldest id
+ * so only expired entries are visited. Returns the number of items aged. */
+int work_id_table_age(struct work_id_table * const tbl, const double secs)
 {
-	struct work *work = NULL;
+	struct timeval tv_now;
+	int aged = 0;
 
-	wr_lock(&cgpu->qlock);
-	work = cgpu->unqueued_work;
-	cgpu->unqueued_work = NULL;
-	wr_unlock(&cgpu->qlock);
+	cgtime(&tv_now);
+	while (tbl->count)
+	{
+		struct work_id_table_entry * const entry = &tbl->entries[tbl->oldest];
+		if (entry->work)
+		{
+			if (tdiff(&tv_now, &entry->work->tv_work_start) <= secs)
+				break;
+			free_work(entry->work);
+			entry->work = NULL;
+			--tbl->count;
+			++aged;
+		}
+		tbl->oldest = (tbl->oldest + 1) & tbl->mask;
+	}
+
+	return aged;
+}
+
+void work_id_table_clear(struct work_id_table * const tbl)
+{
+	for (uint32_t i = 0; tbl->count && i <= tbl->mask; ++i)
+	{
+		if (!tbl->entries[i].work)
+			continue;
+		free_work(tbl->entries[i].work);
+		tbl->entries[i].work = NULL;
+		--tbl->count;
+	}
+}
+
+/* Frees all remaining work and the table itself. */
+void work_id_table_free(struct work_id_table * const tbl)
+{
+	work_id_table_clear(tbl);
+	free(tbl->entries);
+	tbl->entries = NULL;
+}
+
+/* This function should be used by queued device drivers when they're sure
+ * the work struct is no longer in use. */
+void work_completed(struct cgpu_info *cgpu, struct work *work)
+{
+	wr_lock(&cgpu->qlock);
+	__work_completed(cgpu, work);
+	wr_unlock(&cgpu->qlock);
+
+	free_work(work);
+}
+
+/* Combines find_queued_work_bymidstate and work_completed in one function
+ * withOUT destroying the work so the driver must free it. */
+struct work *take_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate, size_t midstatelen, char *data, int offset, size_t datalen)
+{
+	struct work *work;
+
+	wr_lock(&cgpu->qlock);
+	work = __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
+	if (work)
+		__work_completed(cgpu, work);
+	wr_unlock(&cgpu->qlock);
+
+	return work;
+}
+
+void flush_queue(struct cgpu_info *cgpu)
+{
+	struct work *work = NULL;
+
+	wr_lock(&cgpu->qlock);
+	work = cgpu->unqueued_work;
+	cgpu->unqueued_work = NULL;
+	wr_unlock(&cgpu->qlock);
 
 	if (work) {
 		free_work(work);
@@ -11383,6 +11856,227 @@ static void reap_curl(struct pool *pool)
 		applog(LOG_DEBUG, "Reaped %d curl%s from pool %d", reaped, reaped > 1 ? "s" : "", pool->pool_no);
 }
 
+// Idle pools to recheck are tracked by pool->probe_state, with the threads signalled here
+static pthread_mutex_t pool_probe_lock;
+static pthread_cond_t pool_probe_cond;
+static pthread_cond_t pool_check_cond;
+static bool pool_probe_wanted;
+
+#define POOL_PROBE_CONNECT_TIMEOUT  10
+// Full checks of reachable pools that may run at once
+#define POOL_CHECK_THREADS  4
+
+static
+CURL *pool_probe_connect_start(CURLM * const curlm, struct pool * const pool)
+{
+	char *host = NULL, *port = NULL, *url;
+	CURL *curl;
+	
+	if (!extract_sockaddr(pool->rpc_url, &host, &port))
+		return NULL;
+	url = malloc(strlen(host) + strlen(port) + 0x10);
+	sprintf(url, "http://%s:%s/", host, port);
+	free(host);
+	free(port);
+	
+	curl = curl_easy_init();
+	if (unlikely(!curl))
+	{
+		free(url);
+		return NULL;
+	}
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 1);
+	curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, POOL_PROBE_CONNECT_TIMEOUT);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, pool);
+	// Connect the same way the pool's real connections do
+	if (pool->rpc_proxy) {
+		curl_easy_setopt(curl, CURLOPT_HTTPPROXYTUNNEL, 1);
+		curl_easy_setopt(curl, CURLOPT_PROXY, pool->rpc_proxy);
+	} else if (opt_socks_proxy) {
+		curl_easy_setopt(curl, CURLOPT_HTTPPROXYTUNNEL, 1);
+		curl_easy_setopt(curl, CURLOPT_PROXY, opt_socks_proxy);
+		curl_easy_setopt(curl, CURLOPT_PROXYTYPE, CURLPROXY_SOCKS5);
+	}
+	curl_multi_add_handle(curlm, curl);
+	free(url);
+	return curl;
+}
+
+static
+void pool_probe_set_state(struct pool * const pool, const enum pool_probe_state state)
+{
+	mutex_lock(&pool_probe_lock);
+	pool->probe_state = state;
+	if (state == PPS_CHECK_WANTED)
+		pthread_cond_signal(&pool_check_cond);
+	mutex_unlock(&pool_probe_lock);
+}
+
+/* Runs the full pool_active check on pools which accepted a probe connection.
+ * Several of these run at once, so a pool which stalls after connecting only
+ * holds up its own check */
+static
+void *pool_check_thread(__maybe_unused void * const userp)
+{
+	struct pool *pool;
+	int i;
+	
+	pthread_detach(pthread_self());
+	RenameThread("pool_check");
+	
+	while (42)
+	{
+		mutex_lock(&pool_probe_lock);
+		while (true)
+		{
+			pool = NULL;
+			for (i = 0; i < total_pools; ++i)
+				if (pools[i]->probe_state == PPS_CHECK_WANTED)
+				{
+					pool = pools[i];
+					break;
+				}
+			if (pool)
+				break;
+			pthread_cond_wait(&pool_check_cond, &pool_probe_lock);
+		}
+		pool->probe_state = PPS_CHECKING;
+		mutex_unlock(&pool_probe_lock);
+		
+		if (pool_active(pool, true) && pool_tclear(pool, &pool->idle))
+			pool_resus(pool);
+		pool_probe_set_state(pool, PPS_NONE);
+	}
+	return NULL;
+}
+
+/* Rechecks idle pools from one long-lived thread: the TCP connects to every
+ * pool due a check run concurrently in one curl multi handle, so unresponsive
+ * pools only cost a single connect timeout between them. Pools which accept
+ * the connection are handed to the pool_check threads */
+static
+void *pool_probe_thread(__maybe_unused void * const userp)
+{
+	CURLM * const curlm = curl_multi_init();
+	struct timeval tv_timeout;
+	fd_set rfds, wfds, efds;
+	struct pool *pool;
+	CURLMsg *cm;
+	long timeout_ms;
+	int i, n, maxfd, running;
+	
+	pthread_detach(pthread_self());
+	RenameThread("pool_probe");
+	
+	for (i = 0; i < POOL_CHECK_THREADS; ++i)
+	{
+		pthread_t pth;
+		if (unlikely(pthread_create(&pth, NULL, pool_check_thread, NULL)))
+			quit(1, "pool_check thread create failed");
+	}
+	
+	while (42)
+	{
+		mutex_lock(&pool_probe_lock);
+		while (!pool_probe_wanted)
+			pthread_cond_wait(&pool_probe_cond, &pool_probe_lock);
+		pool_probe_wanted = false;
+		
+		const int count = total_pools;
+		CURL *curls[count];
+		bool connecting[count], reachable[count];
+		for (i = 0; i < count; ++i)
+		{
+			pool = pools[i];
+			curls[i] = NULL;
+			reachable[i] = false;
+			connecting[i] = (pool->probe_state == PPS_CONNECT_WANTED);
+			if (connecting[i])
+				pool->probe_state = PPS_CONNECTING;
+		}
+		mutex_unlock(&pool_probe_lock);
+		
+		for (i = 0; i < count; ++i)
+		{
+			pool = pools[i];
+			if (!connecting[i])
+				continue;
+			curls[i] = pool_probe_connect_start(curlm, pool);
+			if (!curls[i])
+				pool_probe_set_state(pool, PPS_NONE);
+		}
+		
+		do {
+			curl_multi_perform(curlm, &running);
+			if (!running)
+				break;
+			FD_ZERO(&rfds);
+			FD_ZERO(&wfds);
+			FD_ZERO(&efds);
+			maxfd = -1;
+			curl_multi_fdset(curlm, &rfds, &wfds, &efds, &maxfd);
+			curl_multi_timeout(curlm, &timeout_ms);
+			if (timeout_ms < 0 || timeout_ms > 1000)
+				timeout_ms = 1000;
+			tv_timeout = (struct timeval){
+				.tv_sec = timeout_ms / 1000,
+				.tv_usec = (timeout_ms % 1000) * 1000,
+			};
+			if (maxfd >= 0)
+				select(maxfd + 1, &rfds, &wfds, &efds, &tv_timeout);
+			else
+				cgsleep_ms(timeout_ms);
+		} while (42);
+		
+		while ((cm = curl_multi_info_read(curlm, &n)))
+		{
+			if (cm->msg != CURLMSG_DONE)
+				continue;
+			for (i = 0; i < count; ++i)
+				if (curls[i] == cm->easy_handle)
+					break;
+			if (i == count)
+				continue;
+			pool = pools[i];
+			if (cm->data.result == CURLE_OK)
+			{
+				double connect_time;
+				if (curl_easy_getinfo(cm->easy_handle, CURLINFO_CONNECT_TIME, &connect_time) == CURLE_OK)
+					pool->probe_rtt = connect_time;
+				reachable[i] = true;
+			}
+			else
+				applog(LOG_DEBUG, "Pool %d: Probe connect failed: %s", pool->pool_no, curl_easy_strerror(cm->data.result));
+		}
+		
+		for (i = 0; i < count; ++i)
+		{
+			if (!curls[i])
+				continue;
+			curl_multi_remove_handle(curlm, curls[i]);
+			curl_easy_cleanup(curls[i]);
+			pool_probe_set_state(pools[i], reachable[i] ? PPS_CHECK_WANTED : PPS_NONE);
+		}
+	}
+	return NULL;
+}
+
+static
+void pool_probe_request(struct pool * const pool)
+{
+	mutex_lock(&pool_probe_lock);
+	if (pool->probe_state == PPS_NONE)
+	{
+		pool->probe_state = PPS_CONNECT_WANTED;
+		pool_probe_wanted = true;
+		pthread_cond_signal(&pool_probe_cond);
+	}
+	mutex_unlock(&pool_probe_lock);
+}
+
 static void *watchpool_thread(void __maybe_unused *userdata)
 {
 	int intervals = 0;
@@ -11425,11 +12119,10 @@ static void *watchpool_thread(void __maybe_unused *userdata)
 				pthread_join(pool->test_thread, NULL);
 			}
 
-			/* Test pool is idle once every minute */
-			if (pool->idle && now.tv_sec - pool->tv_idle.tv_sec > 30) {
-				if (pool_active(pool, true) && pool_tclear(pool, &pool->idle))
-					pool_resus(pool);
-			}
+			/* Test pool is idle once every minute, all at once so
+			 * an unresponsive pool doesn't hold up checking the rest */
+			if (pool->idle && now.tv_sec - pool->tv_idle.tv_sec > 30)
+				pool_probe_request(pool);
 
 			/* Only switch pools if the failback pool has been
 			 * alive for more than 5 minutes (default) to prevent
@@ -12472,6 +13165,9 @@ extern struct sigaction pcwm_orig_term_handler;
 
 bool bfg_need_detect_rescan;
 extern void probe_device(struct lowlevel_device_info *);
+#ifdef HAVE_BFG_LOWLEVEL
+static void probe_cache_prune_unclaimed(const struct lowlevel_device_info *);
+#endif
 static void schedule_rescan(const struct timeval *);
 
 static
@@ -12484,6 +13180,7 @@ rescan:
 #ifdef HAVE_BFG_LOWLEVEL
 	struct lowlevel_device_info * const infolist = lowlevel_scan(), *info, *infotmp;
 	
+	probe_cache_prune_unclaimed(infolist);
 	LL_FOREACH_SAFE(infolist, info, infotmp)
 		probe_device(info);
 	LL_FOREACH_SAFE(infolist, info, infotmp)
@@ -12672,6 +13369,14 @@ bool _probe_device_do_probe(const struct device_drv * const drv, const struct lo
 	bfg_probe_result_flags = 0;
 	if (drv->lowl_probe(info))
 	{
+		// Only devices with a serial number can be recognised again
+		if (info->serial)
+		{
+			char * const signature = probe_cache_signature(info);
+			if (signature)
+				probe_cache_set(&probe_cache_claimed, signature, strdup(signature), drv);
+			free(signature);
+		}
 		if (!(bfg_probe_result_flags & BPR_CONTINUE_PROBES))
 			return true;
 	}
@@ -12681,6 +13386,117 @@ bool _probe_device_do_probe(const struct device_drv * const drv, const struct lo
 	return false;
 }
 
+/* Remembers the outcome of probing each device, so rescans (from hotplug
+ * events, or requested by drivers) can skip devices no driver wanted, and try
+ * the driver that claimed a device first when it is plugged back in. */
+struct probe_cache_entry {
+	char *key;
+	char *signature;
+	const struct device_drv *drv;
+	UT_hash_handle hh;
+};
+static struct probe_cache_entry *probe_cache_unclaimed;  // by devid
+static struct probe_cache_entry *probe_cache_claimed;  // by signature
+static pthread_mutex_t probe_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static
+char *probe_cache_signature(const struct lowlevel_device_info * const info)
+{
+	const char * const manufacturer = info->manufacturer ?: "", * const product = info->product ?: "", * const serial = info->serial ?: "";
+	const size_t sz = strlen(info->lowl->dname) + strlen(manufacturer) + strlen(product) + strlen(serial) + 15;
+	char * const s = malloc(sz);
+	if (unlikely(!s))
+		return NULL;
+	snprintf(s, sz, "%s:%04x:%04x:%s:%s:%s", info->lowl->dname, (unsigned)info->vid, (unsigned)info->pid, manufacturer, product, serial);
+	return s;
+}
+
+static
+void probe_cache_set(struct probe_cache_entry ** const cachep, const char * const key, char * const signature, const struct device_drv * const drv)
+{
+	struct probe_cache_entry *entry;
+	
+	mutex_lock(&probe_cache_mutex);
+	HASH_FIND_STR(*cachep, key, entry);
+	if (!entry)
+	{
+		entry = malloc(sizeof(*entry));
+		*entry = (struct probe_cache_entry){
+			.key = strdup(key),
+		};
+		HASH_ADD_KEYPTR(hh, *cachep, entry->key, strlen(entry->key), entry);
+	}
+	else
+		free(entry->signature);
+	entry->signature = signature;
+	entry->drv = drv;
+	mutex_unlock(&probe_cache_mutex);
+}
+
+// Forgets devices no driver wanted, since something they were not probed for may have changed
+static
+void probe_cache_flush_unclaimed()
+{
+	struct probe_cache_entry *entry, *tmp;
+	
+	mutex_lock(&probe_cache_mutex);
+	HASH_ITER(hh, probe_cache_unclaimed, entry, tmp)
+	{
+		HASH_DEL(probe_cache_unclaimed, entry);
+		free(entry->key);
+		free(entry->signature);
+		free(entry);
+	}
+	mutex_unlock(&probe_cache_mutex);
+}
+
+// Forgets devices no longer present, so they are probed again when plugged back in
+static
+void probe_cache_prune_unclaimed(const struct lowlevel_device_info * const infolist)
+{
+	const struct lowlevel_device_info *info;
+	struct probe_cache_entry *entry, *tmp;
+	
+	mutex_lock(&probe_cache_mutex);
+	HASH_ITER(hh, probe_cache_unclaimed, entry, tmp)
+	{
+		LL_FOREACH(infolist, info)
+			if (!strcmp(info->devid, entry->key))
+				break;
+		if (info)
+			continue;
+		HASH_DEL(probe_cache_unclaimed, entry);
+		free(entry->key);
+		free(entry->signature);
+		free(entry);
+	}
+	mutex_unlock(&probe_cache_mutex);
+}
+
+static
+bool probe_cache_is_unclaimed(const struct lowlevel_device_info * const info, const char * const signature)
+{
+	struct probe_cache_entry *entry;
+	bool rv;
+	
+	mutex_lock(&probe_cache_mutex);
+	HASH_FIND_STR(probe_cache_unclaimed, info->devid, entry);
+	rv = (entry && !strcmp(entry->signature, signature));
+	mutex_unlock(&probe_cache_mutex);
+	return rv;
+}
+
+static
+const struct device_drv *probe_cache_claimed_drv(const char * const signature)
+{
+	struct probe_cache_entry *entry;
+	
+	mutex_lock(&probe_cache_mutex);
+	HASH_FIND_STR(probe_cache_claimed, signature, entry);
+	mutex_unlock(&probe_cache_mutex);
+	return entry ? entry->drv : NULL;
+}
+
 bool dummy_check_never_true = false;
 
 static
@@ -12701,6 +13517,15 @@ void *probe_device_thread(void *p)
 		applogr(NULL, LOG_DEBUG, "%s: \"%s\" already in use",
 		        __func__, info->product);
 	
+	char * const signature = probe_cache_signature(infolist);
+	if (signature && probe_cache_is_unclaimed(infolist, signature))
+	{
+		applog(LOG_DEBUG, "%s: \"%s\" was not claimed by any driver last scan, skipping",
+		       __func__, infolist->product);
+		free(signature);
+		return NULL;
+	}
+	
 	// if lowlevel device matches specific user assignment, probe requested driver(s)
 	struct string_elist *sd_iter, *sd_tmp;
 	struct driver_registration *dreg;
@@ -12728,11 +13553,22 @@ void *probe_device_thread(void *p)
 				if (strcasecmp(drv->dname, dname_nt) && strcasecmp(drv->name, dname_nt))
 					continue;
 				if (_probe_device_do_probe(drv, info, &request_rescan))
-					return NULL;
+					goto out;
 			}
 		}
 	}
 	
+	// probe the driver that claimed this device before, if it is plugged back in
+	const struct device_drv * const cached_drv = signature ? probe_cache_claimed_drv(signature) : NULL;
+	if (cached_drv && cached_drv->lowl_probe && drv_algo_check(cached_drv))
+	{
+		applog(LOG_DEBUG, "%s: Probing \"%s\" with %s first, which claimed it before",
+		       __func__, infolist->product, cached_drv->dname);
+		LL_FOREACH2(infolist, info, same_devid_next)
+			if (_probe_device_do_probe(cached_drv, info, &request_rescan))
+				goto out;
+	}
+	
 	// probe driver(s) with auto enabled and matching VID/PID/Product/etc of device
 	BFG_FOREACH_DRIVER_BY_PRIORITY(dreg)
 	{
@@ -12792,7 +13628,7 @@ void *probe_device_thread(void *p)
 				if (!drv->lowl_match(info))
 					continue;
 				if (_probe_device_do_probe(drv, info, &request_rescan))
-					return NULL;
+					goto out;
 			}
 		}
 	}
@@ -12824,7 +13660,7 @@ void *probe_device_thread(void *p)
 						if (!drv->lowl_probe)
 							continue;
 						if (_probe_device_do_probe(drv, info, NULL))
-							return NULL;
+							goto out;
 						if (bfg_probe_result_flags & BPR_DONT_RESCAN)
 							dont_rescan = true;
 					}
@@ -12853,7 +13689,7 @@ void *probe_device_thread(void *p)
 				if (info->lowl->exclude_from_all)
 					continue;
 				if (_probe_device_do_probe(drv, info, NULL))
-					return NULL;
+					goto out;
 			}
 		}
 	}
@@ -12861,7 +13697,16 @@ void *probe_device_thread(void *p)
 	// Only actually request a rescan if we never found any cgpu
 	if (request_rescan)
 		bfg_need_detect_rescan = true;
+	else
+	if (signature)
+	{
+		// Nothing wanted it, and no driver expects it to change; don't probe it again
+		probe_cache_set(&probe_cache_unclaimed, infolist->devid, signature, NULL);
+		return NULL;
+	}
 	
+out:
+	free(signature);
 	return NULL;
 }
 
@@ -12956,8 +13801,12 @@ out:
 	return devcount;
 }
 
+// Explicitly requested scans probe every device again
 int scan_serial(const char *s)
 {
+#ifdef HAVE_BFG_LOWLEVEL
+	probe_cache_flush_unclaimed();
+#endif
 	return create_new_cgpus(_scan_serial, (void*)s);
 }
 
@@ -13001,7 +13850,7 @@ void *rescan_thread(__maybe_unused void *p)
 			timer_unset(&tv_rescan);
 			mutex_unlock(&rescan_mutex);
 			applog(LOG_DEBUG, "Rescan timer expired, triggering");
-			scan_serial(NULL);
+			create_new_cgpus(_scan_serial, NULL);
 		}
 		else
 			mutex_unlock(&rescan_mutex);
@@ -13102,7 +13951,8 @@ void *hotplug_thread(__maybe_unused void *p)
 			continue;
 		const char * const action = udev_device_get_action(device);
 		applog(LOG_DEBUG, "%s: Received %s event", __func__, action);
-		if (!strcmp(action, "add"))
+		// Removals rescan too, so the probe cache forgets unplugged devices
+		if (!(strcmp(action, "add") && strcmp(action, "remove")))
 			pending = true;
 		udev_device_unref(device);
 	}
@@ -13228,6 +14078,201 @@ extern void bfg_init_threadlocal();
 extern bool stratumsrv_change_port(unsigned);
 extern void test_aan_pll(void);
 
+// Fetch the next GBT template in the background once the current one has this few seconds left
+#define GBT_PREFETCH_TIME_LEFT  10
+
+/* Returns whether work can be generated locally from the latest template of a
+ * GBT pool, instead of waiting on a getblocktemplate request */
+static
+bool pool_gbt_swork_usable(struct pool * const pool)
+{
+	struct blockchain_info * const blkchain = pool->goal->blkchain;
+	struct timeval tv_now;
+	uint32_t block_id;
+	bool rv;
+	
+	if (pool->has_stratum || pool->proto != PLP_GETBLOCKTEMPLATE)
+		return false;
+	// Pools that failed to return a template are left to the failover path
+	if (pool->idle)
+		return false;
+	
+	rd_lock(&blk_lock);
+	block_id = blkchain->currentblk->block_id;
+	rd_unlock(&blk_lock);
+	
+	timer_set_now(&tv_now);
+	cg_rlock(&pool->data_lock);
+	rv = (pool->swork.tr
+	      && pool->swork.work_restart_id == pool->work_restart_id
+	      && ((uint32_t*)pool->swork.header1)[1] == block_id
+	      && blkmk_time_left(pool->swork.tr->tmpl, tv_now.tv_sec) > 0);
+	cg_runlock(&pool->data_lock);
+	return rv;
+}
+
+static
+void *gbt_prefetch_thread(void * const userp)
+{
+	struct pool * const pool = userp;
+	struct work * const work = make_work();
+	struct curl_ent *ce;
+	
+	pthread_detach(pthread_self());
+	RenameThread("gbt_prefetch");
+	
+	work->pool = pool;
+	ce = pop_curl_entry3(pool, 2);
+	// NOTE: Decoding the template replaces pool->swork, so local work generation carries on from it
+	if (get_upstream_work(work, ce->curl))
+	{
+		applog(LOG_DEBUG, "Pool %u: Prefetched next GBT template", pool->pool_no);
+		push_curl_entry(ce, pool);
+		if (pool_tclear(pool, &pool->idle))
+			pool_resus(pool);
+		stage_work(work);
+	}
+	else
+	{
+		// Don't keep generating work from a template the pool may no longer be serving
+		applog(LOG_WARNING, "Pool %u: GBT template prefetch failed", pool->pool_no);
+		push_curl_entry(ce, pool);
+		free_work(work);
+		++pool->seq_getfails;
+		pool_died(pool);
+	}
+	pool_tclear(pool, &pool->gbt_prefetching);
+	return NULL;
+}
+
+// Starts fetching a new template if the pool's current one is about to expire
+static
+void gbt_prefetch_check(struct pool * const pool)
+{
+	struct timeval tv_now;
+	pthread_t pth;
+	int time_left;
+	
+	timer_set_now(&tv_now);
+	cg_rlock(&pool->data_lock);
+	time_left = pool->swork.tr ? blkmk_time_left(pool->swork.tr->tmpl, tv_now.tv_sec) : 0;
+	cg_runlock(&pool->data_lock);
+	if (time_left > GBT_PREFETCH_TIME_LEFT)
+		return;
+	if (pool_tset(pool, &pool->gbt_prefetching))
+		return;
+	if (unlikely(pthread_create(&pth, NULL, gbt_prefetch_thread, pool)))
+	{
+		applog(LOG_ERR, "Pool %u: Failed to create GBT prefetch thread", pool->pool_no);
+		pool_tclear(pool, &pool->gbt_prefetching);
+	}
+}
+
+#define WORK_GEN_MAX_BATCH  0x40
+
+// Charges a pool for works staged beyond the one select_pool accounted for
+static
+void pool_charge_works(struct pool * const pool, const int works)
+{
+	mutex_lock(&pool_select_lock);
+	switch (pool_strategy)
+	{
+		case POOL_LOADBALANCE:
+			pool->quota_used += works;
+			break;
+		case POOL_BALANCE:
+			pool->shares += works;
+			break;
+		case POOL_LATENCYBALANCE:
+			pool->lb_pass += works / pool_latency_weight(pool);
+			break;
+		default:
+			break;
+	}
+	mutex_unlock(&pool_select_lock);
+}
+
+// Tells work_gen threads which pool main is generating work from (NULL to stop them)
+static
+void work_gen_set_pool(struct pool * const pool)
+{
+	if (!opt_work_gen_threads)
+		return;
+	mutex_lock(stgd_lock);
+	if (work_gen_pool != pool)
+	{
+		work_gen_pool = pool;
+		pthread_cond_broadcast(&gws_cond);
+	}
+	mutex_unlock(stgd_lock);
+}
+
+/* Helps the getwork scheduler in main by generating stratum (or GBT template)
+ * work in batches, each thread taking a share of the staged work deficit.
+ * Pools are only ever selected by main, which hands them over here */
+static
+void *work_gen_thread(void * const userp)
+{
+	struct work *batch[WORK_GEN_MAX_BATCH];
+	struct pool *pool;
+	int want, i;
+	
+	pthread_detach(pthread_self());
+	RenameThread("work_gen");
+	
+	while (42)
+	{
+		mutex_lock(stgd_lock);
+		want = opt_queue + base_queue + 1 - (__total_staged(false) + work_gen_pending);
+		pool = work_gen_pool;
+		if (want <= 0 || !pool)
+		{
+			pthread_cond_wait(&gws_cond, stgd_lock);
+			mutex_unlock(stgd_lock);
+			continue;
+		}
+		mutex_unlock(stgd_lock);
+		
+		// Only stratum and GBT template work is made here; everything else is left to main
+		if (!((pool->has_stratum && pool->stratum_active && pool->stratum_notify) || pool_gbt_swork_usable(pool)))
+		{
+			// Wait for main to choose a pool again
+			mutex_lock(stgd_lock);
+			if (work_gen_pool == pool)
+				work_gen_pool = NULL;
+			mutex_unlock(stgd_lock);
+			continue;
+		}
+		
+		mutex_lock(stgd_lock);
+		want = opt_queue + base_queue + 1 - (__total_staged(false) + work_gen_pending);
+		want = (want + opt_work_gen_threads - 1) / opt_work_gen_threads;
+		if (want > WORK_GEN_MAX_BATCH)
+			want = WORK_GEN_MAX_BATCH;
+		if (want > 0)
+			work_gen_pending += want;
+		mutex_unlock(stgd_lock);
+		if (want <= 0)
+			continue;
+		
+		for (i = 0; i < want; ++i)
+		{
+			batch[i] = make_work();
+			gen_stratum_work(pool, batch[i]);
+		}
+		applog(LOG_DEBUG, "Generated %d stratum works in batch", want);
+		pool_charge_works(pool, want);
+		stage_works(batch, want);
+		if (!pool->has_stratum)
+			gbt_prefetch_check(pool);
+		
+		mutex_lock(stgd_lock);
+		work_gen_pending -= want;
+		mutex_unlock(stgd_lock);
+	}
+	return NULL;
+}
+
 int main(int argc, char *argv[])
 {
 	struct sigaction handler;
@@ -13283,6 +14328,12 @@ int main(int argc, char *argv[])
 	rwlock_init(&mining_thr_lock);
 	rwlock_init(&devices_lock);
 
+	mutex_init(&pool_select_lock);
+	mutex_init(&pool_probe_lock);
+	if (unlikely(pthread_cond_init(&pool_probe_cond, bfg_condattr)))
+		quit(1, "Failed to pthread_cond_init pool_probe_cond");
+	if (unlikely(pthread_cond_init(&pool_check_cond, bfg_condattr)))
+		quit(1, "Failed to pthread_cond_init pool_check_cond");
 	mutex_init(&lp_lock);
 	if (unlikely(pthread_cond_init(&lp_cond, bfg_condattr)))
 		quit(1, "Failed to pthread_cond_init lp_cond");
@@ -13750,6 +14801,12 @@ begin_bench:
 			quit(1, "submit_work thread create failed");
 	}
 
+	{
+		pthread_t pool_probe_pth;
+		if (unlikely(pthread_create(&pool_probe_pth, NULL, pool_probe_thread, NULL)))
+			quit(1, "pool_probe thread create failed");
+	}
+
 	watchpool_thr_id = 1;
 	thr = &control_thr[watchpool_thr_id];
 	/* start watchpool thread */
@@ -13811,6 +14868,13 @@ begin_bench:
 	if (total_control_threads != 6)
 		quit(1, "incorrect total_control_threads (%d) should be 7", total_control_threads);
 
+	for (i = 0; i < opt_work_gen_threads; ++i)
+	{
+		pthread_t pth;
+		if (unlikely(pthread_create(&pth, NULL, work_gen_thread, NULL)))
+			quit(1, "work_gen thread create failed");
+	}
+
 	/* Once everything is set up, main() becomes the getwork scheduler */
 	while (42) {
 		int ts, max_staged = opt_queue;
@@ -13826,7 +14890,7 @@ begin_bench:
 		max_staged += base_queue;
 
 		mutex_lock(stgd_lock);
-		ts = __total_staged(false);
+		ts = __total_staged(false) + work_gen_pending;
 
 		if (!pool_localgen(cp) && !ts && !opt_fail_only)
 			lagging = true;
@@ -13857,7 +14921,7 @@ begin_bench:
 			}
 			staged_full = true;
 			pthread_cond_wait(&gws_cond, stgd_lock);
-			ts = __total_staged(false);
+			ts = __total_staged(false) + work_gen_pending;
 		}
 		mutex_unlock(stgd_lock);
 
@@ -13886,6 +14950,18 @@ retry:
 			gen_stratum_work(pool, work);
 			applog(LOG_DEBUG, "Generated stratum work");
 			stage_work(work);
+			if (!malgo)
+				work_gen_set_pool(pool);
+			continue;
+		}
+
+		if (pool_gbt_swork_usable(pool)) {
+			gen_stratum_work(pool, work);
+			applog(LOG_DEBUG, "Generated work from latest GBT template");
+			stage_work(work);
+			gbt_prefetch_check(pool);
+			if (!malgo)
+				work_gen_set_pool(pool);
 			continue;
 		}
 
@@ -13927,6 +15003,8 @@ retry:
 			continue;
 		}
 
+		if (!malgo)
+			work_gen_set_pool(NULL);
 		work->pool = pool;
 		ce = pop_curl_entry3(pool, 2);
 		/* obtain new work from bitcoin via JSON-RPC */
@@ -233,9 +233,10 @@ enum pool_strategy {
 	POOL_ROTATE,
 	POOL_LOADBALANCE,
 	POOL_BALANCE,
+	POOL_LATENCYBALANCE,
 };
 
-#define TOP_STRATEGY (POOL_BALANCE)
+#define TOP_STRATEGY (POOL_LATENCYBALANCE)
 
 struct strategies {
 	const char *s;
@@ -297,6 +298,7 @@ struct api_data;
 struct thr_info;
 struct work;
 struct lowlevel_device_info;
+struct nonce_partition;
 
 enum bfg_probe_result_flags_values {
 	BPR_CONTINUE_PROBES = 1<< 0,
@@ -371,6 +373,8 @@ struct device_drv {
 	// === Implemented by minerloop_queue ===
 	bool (*queue_append)(struct thr_info *, struct work *);
 	void (*queue_flush)(struct thr_info *);
+	// Optional: number of works queue_append can currently take, so they can be fetched together
+	int (*queue_space)(struct thr_info *);
 };
 
 enum dev_enable {
@@ -445,6 +449,10 @@ struct cgminer_stats {
 	struct timeval _get_start;
 };
 
+// Upper bounds (in seconds) of share submission latency histogram buckets
+#define POOL_SUBMIT_LATENCY_BUCKETS  8
+extern const double pool_submit_latency_bounds[POOL_SUBMIT_LATENCY_BUCKETS];
+
 // Just the actual network getworks to the pool
 struct cgminer_pool_stats {
 	uint32_t getwork_calls;
@@ -468,6 +476,16 @@ struct cgminer_pool_stats {
 	uint64_t times_received;
 	uint64_t bytes_received;
 	uint64_t net_bytes_received;
+	
+	// Not cumulative; the last bucket counts everything above the bounds
+	uint32_t submit_latency_hist[POOL_SUBMIT_LATENCY_BUCKETS + 1];
+	uint32_t submit_latency_count;
+	double submit_latency_sum;
+	
+	// Latest GBT template
+	uint32_t template_txns;
+	uint64_t template_bytes;
+	double template_fetch_time;
 };
 
 
@@ -532,6 +550,9 @@ struct cgpu_info {
 #endif
 	pthread_mutex_t		device_mutex;
 	pthread_cond_t	device_cond;
+	// Used by cgpu_request_control, protected by device_mutex
+	int control_requests;
+	bool control_granted;
 
 	enum dev_enable deven;
 	bool already_set_defaults;
@@ -591,6 +612,9 @@ struct cgpu_info {
 	struct work *queued_work;
 	struct work *unqueued_work;
 	unsigned int queued_count;
+	
+	// Used by minerloop_scanhash to share one work between threads (may be shared between processors)
+	struct nonce_partition *nonce_partition;
 
 	bool disable_watchdog;
 	bool shutdown;
@@ -657,10 +681,15 @@ struct thr_info {
 	bool starting_next_work;
 	uint32_t _max_nonce;
 	notifier_t mutex_request;
+	bool _notifier_epoll_ready;
+	bool _notifier_epoll_failed;
+	int _notifier_epollfd;
+	SOCKETTYPE _notifier_epoll_fds[3];
 
 	// Used by minerloop_queue
 	struct work *work_list;
 	bool queue_full;
+	struct work *_queue_pending;
 
 	bool	work_restart;
 	notifier_t work_restart_notifier;
@@ -996,6 +1025,7 @@ extern char *opt_api_groups;
 extern char *opt_api_description;
 extern int opt_api_port;
 extern bool opt_api_listen;
+extern bool opt_api_keepalive;
 extern bool opt_api_network;
 extern bool opt_delaynet;
 extern time_t last_getwork;
@@ -1104,6 +1134,20 @@ extern int set_memoryclock(int gpu, int iMemoryClock);
 
 extern void api(int thr_id);
 
+enum api_event_class {
+	APIEV_DEVICES = 1 << 0,
+	APIEV_SHARES  = 1 << 1,
+	APIEV_POOLS   = 1 << 2,
+	APIEV_BLOCKS  = 1 << 3,
+};
+struct mining_goal_info;
+struct block_info;
+extern int api_subscribed_events;
+extern void api_event_devices(void);
+extern void api_event_share(const struct cgpu_info *, const struct work *, const char *result);
+extern void api_event_pool_switch(struct pool *);
+extern void api_event_block(const struct mining_goal_info *, const struct block_info *);
+
 extern struct pool *current_pool(void);
 extern int enabled_pools;
 extern bool get_intrange(const char *arg, int *val1, int *val2);
@@ -1215,6 +1259,7 @@ extern int total_devices_new;
 extern struct cgpu_info **devices_new;
 extern int total_pools;
 extern struct pool **pools;
+extern void pool_record_submit_latency(struct pool *, double secs);
 extern const char *algo_names[];
 extern enum sha256_algos opt_algo;
 extern struct strategies strategies[];
@@ -1263,6 +1308,15 @@ enum pool_protocol {
 	PLP_GETBLOCKTEMPLATE,
 };
 
+// Progress of an idle pool recheck
+enum pool_probe_state {
+	PPS_NONE,
+	PPS_CONNECT_WANTED,
+	PPS_CONNECTING,
+	PPS_CHECK_WANTED,
+	PPS_CHECKING,
+};
+
 struct bfg_tmpl_ref {
 	blktemplate_t *tmpl;
 	int refcount;
@@ -1311,6 +1365,20 @@ struct stratum_work {
 	
 	struct pool *pool;
 	unsigned char work_restart_id;
+	// Bumped (with data_lock held) every time the job contents change
+	unsigned generation;
+};
+
+/* A private copy of a pool's current job plus a reserved block of nonce2
+ * values, letting a device make new work without the pool's locks */
+struct local_work_gen {
+	struct pool *pool;
+	struct stratum_work swork;
+	uint64_t nonce2;
+	uint64_t nonce2_end;
+	int nonce2sz;
+	int nonce2off;
+	float nonce_diff;
 };
 
 #define RBUFSIZE 8192
@@ -1353,6 +1421,7 @@ struct pool {
 	bool submit_fail;
 	bool idle;
 	bool lagging;
+	bool gbt_prefetching;
 	bool probed;
 	int force_rollntime;
 	enum pool_enable enabled;
@@ -1385,6 +1454,11 @@ struct pool {
 
 	double utility;
 	int last_shares, shares;
+	
+	// Rolling averages and scheduling position for the latency balance strategy
+	double lb_submit_rtt;
+	double lb_reject_ratio;
+	double lb_pass;
 
 	char *rpc_url;
 	char *rpc_userpass;
@@ -1401,6 +1475,9 @@ struct pool {
 	pthread_t longpoll_thread;
 	pthread_t test_thread;
 	bool testing;
+	enum pool_probe_state probe_state;  // under pool_probe_lock
+	// Seconds taken to connect by the latest successful idle pool probe
+	double probe_rtt;
 
 	int curls;
 	pthread_cond_t cr_cond;
@@ -1464,43 +1541,50 @@ struct pool {
 typedef unsigned work_device_id_t;
 #define PRIwdi "04x"
 
+/* Fields used for every hash, nonce test and share check come first so they
+ * share as few cache lines as possible; bookkeeping follows */
 struct work {
 	unsigned char	data[128];
 	unsigned char	midstate[32];
 	unsigned char	target[32];
 	unsigned char	hash[32];
 
-	double share_diff;
-
-	int		rolls;
-	struct ntime_roll_limits ntime_roll_limits;
-
 	struct {
 		uint32_t nonce;
 	} blk;
-
+	float		nonce_diff;
+	double		work_difficulty;
+	struct pool	*pool;
 	struct thr_info	*thr;
 	int		thr_id;
-	struct pool	*pool;
+	int		id;
+	unsigned char	work_restart_id;
+	bool		stratum;
+	bool		mined;
+	bool		stale;
+	bool		mandatory;
+	bool		block;
+	char		getwork_mode;
+	// stratum_work generation this work was made from
+	unsigned	swork_generation;
+	char 		*job_id;
 	struct timeval	tv_staged;
 
-	bool		mined;
+	/* Everything below is not normally touched in hot paths */
+	double share_diff;
+
+	int		rolls;
+	struct ntime_roll_limits ntime_roll_limits;
+
 	bool		clone;
 	bool		cloned;
 	int		rolltime;
 	bool		longpoll;
-	bool		stale;
-	bool		mandatory;
 	bool spare;
-	bool		block;
 
-	bool		stratum;
-	char 		*job_id;
 	bytes_t		nonce2;
 	char		*nonce1;
 
-	unsigned char	work_restart_id;
-	int		id;
 	work_device_id_t device_id;
 	UT_hash_handle hh;
 	
@@ -1508,9 +1592,6 @@ struct work {
 	void *device_data;
 	void *(*device_data_dup_func)(struct work *);
 	void (*device_data_free_func)(struct work *);
-	
-	double		work_difficulty;
-	float		nonce_diff;
 
 	// Allow devices to identify work if multiple sub-devices
 	// DEPRECATED: New code should be using multiple processors instead
@@ -1529,7 +1610,6 @@ struct work {
 	struct timeval	tv_cloned;
 	struct timeval	tv_work_start;
 	struct timeval	tv_work_found;
-	char		getwork_mode;
 
 	/* Used to queue shares in submit_waiting */
 	struct work *prev;
@@ -1544,6 +1624,9 @@ extern void stratum_work_clean(struct stratum_work *);
 extern bool pool_has_usable_swork(const struct pool *);
 extern void gen_stratum_work2(struct work *, struct stratum_work *);
 extern void gen_stratum_work3(struct work *, struct stratum_work *, cglock_t *data_lock_p);
+extern bool local_work_gen_init(struct local_work_gen *, const struct work *);
+extern struct work *local_work_gen_next(struct local_work_gen *);
+extern void local_work_gen_clean(struct local_work_gen *);
 extern void inc_hw_errors3(struct thr_info *thr, const struct work *work, const uint32_t *bad_nonce_p, float nonce_diff);
 static inline
 void inc_hw_errors2(struct thr_info * const thr, const struct work * const work, const uint32_t *bad_nonce_p)
@@ -1580,6 +1663,25 @@ extern int age_queued_work(struct cgpu_info *cgpu, double secs);
 extern void work_completed(struct cgpu_info *cgpu, struct work *work);
 extern struct work *take_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate, size_t midstatelen, char *data, int offset, size_t datalen);
 extern void flush_queue(struct cgpu_info *cgpu);
+
+// Queued work indexed by a device-assigned id, for constant time lookup of results
+struct work_id_table {
+	struct work_id_table_entry {
+		uint32_t id;
+		struct work *work;
+	} *entries;
+	uint32_t mask;
+	// Ids should be assigned sequentially, so the oldest work is found by walking forward
+	uint32_t oldest;
+	int count;
+};
+extern void work_id_table_init(struct work_id_table *, uint32_t size);
+extern struct work *work_id_table_add(struct work_id_table *, uint32_t id, struct work *);
+extern struct work *work_id_table_find(struct work_id_table *, uint32_t id);
+extern struct work *work_id_table_take(struct work_id_table *, uint32_t id);
+extern int work_id_table_age(struct work_id_table *, double secs);
+extern void work_id_table_clear(struct work_id_table *);
+extern void work_id_table_free(struct work_id_table *);
 extern bool abandon_work(struct work *, struct timeval *work_runtime, uint64_t hashes);
 extern void hash_queued_work(struct thr_info *mythr);
 extern void get_statline3(char *buf, size_t bufsz, struct cgpu_info *, bool for_curses, bool opt_show_procs);
@@ -0,0 +1,428 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Simulated mining devices, each served on the master side of a pseudo
+ * terminal, so drivers can be exercised through their real serial code paths
+ * without hardware. Found nonces are real (difficulty 1) results. */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#include "logging.h"
+#include "miner.h"
+#include "sha2.h"
+#include "simulator.h"
+#include "util.h"
+
+// Nonces hashed between checks for new jobs
+#define BFG_SIM_HASH_CHUNK  0x1000
+// Partial jobs are discarded after this long without more data
+#define BFG_SIM_PARTIAL_JOB_TIMEOUT_US  100000
+// Nonces a simulated BitFORCE holds until the host polls for them
+#define BFG_SIM_BFL_MAX_NONCES  0x10
+
+struct bfg_sim_device;
+
+struct bfg_sim_protocol {
+	const char *name;
+	// Driver to scan the simulated device with
+	const char *dname;
+
+	// Bytes the device expects next from the host, passed together to input
+	size_t (*input_size)(const struct bfg_sim_device *);
+	void (*input)(struct bfg_sim_device *, const uint8_t *buf);
+	bool (*nonce_test)(struct bfg_sim_device *, uint32_t nonce);
+	void (*nonce_send)(struct bfg_sim_device *, uint32_t nonce);
+};
+
+struct bfg_sim_device {
+	const struct bfg_sim_protocol *proto;
+	int masterfd;
+	int slavefd;
+	char *devpath;
+
+	unsigned latency_ms;
+	float error_percent;
+	double hashrate;
+
+	uint8_t jobbuf[0x40];
+	size_t jobbuflen;
+	struct timeval tv_last_recv;
+
+	bool working;
+	uint32_t next_nonce;
+	struct timeval tv_job_start;
+
+	// Job state for SHA256d protocols
+	sha256_ctx midstate_ctx;
+	uint8_t block2[0x10];
+
+	// BitFORCE protocol state
+	bool bfl_want_job;
+	uint32_t bfl_nonces[BFG_SIM_BFL_MAX_NONCES];
+	int bfl_nonces_count;
+};
+
+static
+void bfg_sim_reply(struct bfg_sim_device * const sim, const char * const reply)
+{
+	const size_t replylen = strlen(reply);
+	if (replylen != write(sim->masterfd, reply, replylen))
+		applog(LOG_DEBUG, "Simulated device %s: Failed to send reply", sim->devpath);
+}
+
+static
+void bfg_sim_job_begin(struct bfg_sim_device * const sim)
+{
+	sim->working = true;
+	sim->next_nonce = 0;
+	timer_set_now(&sim->tv_job_start);
+}
+
+// Takes the midstate and data tail in struct work byte order
+static
+void bfg_sim_sha256d_job_set(struct bfg_sim_device * const sim, const uint8_t * const midstate, const uint8_t * const datatail)
+{
+	for (int i = 0; i < 8; ++i)
+		sim->midstate_ctx.h[i] = le32toh(((const uint32_t *)midstate)[i]);
+	sim->midstate_ctx.len = 0;
+	sim->midstate_ctx.tot_len = 0x40;
+	swap32yes(sim->block2, datatail, 3);
+}
+
+static
+size_t bfg_sim_icarus_input_size(__maybe_unused const struct bfg_sim_device * const sim)
+{
+	return 0x40;
+}
+
+static
+void bfg_sim_icarus_input(struct bfg_sim_device * const sim, const uint8_t * const job)
+{
+	uint32_t midstate[8], data[3];
+
+	// Undo icarus_job_prepare's byte order changes
+	swab256(midstate, job);
+	bswap_96p(data, &job[0x34]);
+
+	bfg_sim_sha256d_job_set(sim, (void *)midstate, (void *)data);
+	bfg_sim_job_begin(sim);
+
+	// This sequence is used by cairnsmore for commands, which simulated devices ignore
+	if (!(memcmp(&job[0x38], "\xff\xff\xff\xff", 4) || memcmp(job, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 0x20)))
+		sim->working = false;
+}
+
+static
+bool bfg_sim_sha256d_nonce_test(struct bfg_sim_device * const sim, const uint32_t nonce)
+{
+	sha256_ctx ctx = sim->midstate_ctx;
+	uint8_t hash1[0x20], hash[0x20];
+
+	*(uint32_t *)&sim->block2[0xc] = htobe32(nonce);
+	sha256_update(&ctx, sim->block2, sizeof(sim->block2));
+	sha256_final(&ctx, hash1);
+	sha256(hash1, sizeof(hash1), hash);
+	return !(hash[0x1c] | hash[0x1d] | hash[0x1e] | hash[0x1f]);
+}
+
+static
+void bfg_sim_icarus_nonce_send(struct bfg_sim_device * const sim, const uint32_t nonce)
+{
+	const uint32_t nonce_be = htobe32(nonce);
+	if (sizeof(nonce_be) != write(sim->masterfd, &nonce_be, sizeof(nonce_be)))
+		applog(LOG_DEBUG, "Simulated device %s: Failed to send nonce", sim->devpath);
+}
+
+// Single FPGA BitFORCE: 3-byte commands, with ZDX followed by a 60-byte job
+static
+size_t bfg_sim_bitforce_input_size(const struct bfg_sim_device * const sim)
+{
+	return sim->bfl_want_job ? 60 : 3;
+}
+
+static
+void bfg_sim_bitforce_results(struct bfg_sim_device * const sim)
+{
+	char reply[12 + (BFG_SIM_BFL_MAX_NONCES * 9) + 1], *p;
+
+	if (sim->working)
+	{
+		bfg_sim_reply(sim, "BUSY\n");
+		return;
+	}
+	if (!sim->bfl_nonces_count)
+	{
+		bfg_sim_reply(sim, "NO-NONCE\n");
+		return;
+	}
+	p = reply + sprintf(reply, "NONCE-FOUND:");
+	for (int i = 0; i < sim->bfl_nonces_count; ++i)
+		p += sprintf(p, "%s%08lx", i ? "," : "", (unsigned long)sim->bfl_nonces[i]);
+	strcpy(p, "\n");
+	sim->bfl_nonces_count = 0;
+	bfg_sim_reply(sim, reply);
+}
+
+static
+void bfg_sim_bitforce_input(struct bfg_sim_device * const sim, const uint8_t * const buf)
+{
+	if (sim->bfl_want_job)
+	{
+		// ">>>>>>>>|---------- MidState ----------||-DataTail-|>>>>>>>>"
+		sim->bfl_want_job = false;
+		if (memcmp(buf, ">>>>>>>>", 8) || memcmp(&buf[8+32+12], ">>>>>>>>", 8))
+		{
+			bfg_sim_reply(sim, "ERR:INVALID DATA\n");
+			return;
+		}
+		bfg_sim_sha256d_job_set(sim, &buf[8], &buf[8+32]);
+		sim->bfl_nonces_count = 0;
+		bfg_sim_job_begin(sim);
+		bfg_sim_reply(sim, "OK\n");
+		return;
+	}
+
+	if (!memcmp(buf, "ZGX", 3))
+		bfg_sim_reply(sim, ">>>ID: BitFORCE SHA256 Simulator>>>\n");
+	else
+	if (!memcmp(buf, "ZCX", 3))
+		bfg_sim_reply(sim, "DEVICE: BitFORCE SHA256\nOK\n");
+	else
+	if (!memcmp(buf, "ZDX", 3))
+	{
+		if (sim->working)
+			bfg_sim_reply(sim, "BUSY\n");
+		else
+		{
+			sim->bfl_want_job = true;
+			bfg_sim_reply(sim, "OK\n");
+		}
+	}
+	else
+	if (!memcmp(buf, "ZFX", 3))
+		bfg_sim_bitforce_results(sim);
+	else
+	if (!memcmp(buf, "ZLX", 3))
+		bfg_sim_reply(sim, "Temp:30.0\n");
+	else
+	if (!memcmp(buf, "ZQX", 3))
+		bfg_sim_reply(sim, "OK\n");
+	else
+	if (!memcmp(buf, "ZMX", 3))
+	{}  // Flashing the LED has no reply
+	else
+		// Includes nonce range (ZPX), which makes the driver fall back to ZDX
+		bfg_sim_reply(sim, "ERR:UNKNOWN COMMAND\n");
+}
+
+static
+void bfg_sim_bitforce_nonce_send(struct bfg_sim_device * const sim, const uint32_t nonce)
+{
+	if (sim->bfl_nonces_count < BFG_SIM_BFL_MAX_NONCES)
+		sim->bfl_nonces[sim->bfl_nonces_count++] = nonce;
+}
+
+static const struct bfg_sim_protocol bfg_sim_protocols[] = {
+#ifdef USE_ICARUS
+	{
+		.name = "icarus",
+		.dname = "icarus",
+		.input_size = bfg_sim_icarus_input_size,
+		.input = bfg_sim_icarus_input,
+		.nonce_test = bfg_sim_sha256d_nonce_test,
+		.nonce_send = bfg_sim_icarus_nonce_send,
+	},
+#endif
+#ifdef USE_BITFORCE
+	{
+		.name = "bitforce",
+		.dname = "bitforce",
+		.input_size = bfg_sim_bitforce_input_size,
+		.input = bfg_sim_bitforce_input,
+		.nonce_test = bfg_sim_sha256d_nonce_test,
+		.nonce_send = bfg_sim_bitforce_nonce_send,
+	},
+#endif
+	{.name = NULL},
+};
+
+static
+void bfg_sim_found(struct bfg_sim_device * const sim, uint32_t nonce)
+{
+	if (sim->latency_ms)
+		cgsleep_ms(sim->latency_ms);
+	if (sim->error_percent && rand() < (RAND_MAX / 100.) * sim->error_percent)
+		// Corrupt it, as a hardware error would
+		nonce ^= 1 << (rand() % 32);
+	sim->proto->nonce_send(sim, nonce);
+}
+
+static
+void bfg_sim_hash(struct bfg_sim_device * const sim)
+{
+	const struct bfg_sim_protocol * const proto = sim->proto;
+	uint32_t nonce = sim->next_nonce;
+
+	if (sim->hashrate)
+	{
+		// Don't get ahead of the simulated hashrate
+		const double elapsed = timer_elapsed_us(&sim->tv_job_start, NULL) / 1e6;
+		if (nonce > elapsed * sim->hashrate)
+		{
+			cgsleep_ms(1);
+			return;
+		}
+	}
+
+	for (int i = 0; i < BFG_SIM_HASH_CHUNK; ++i, ++nonce)
+	{
+		if (proto->nonce_test(sim, nonce))
+			bfg_sim_found(sim, nonce);
+		if (nonce == UINT32_MAX)
+		{
+			sim->working = false;
+			return;
+		}
+	}
+	sim->next_nonce = nonce;
+}
+
+static
+void *bfg_sim_thread(void * const userp)
+{
+	struct bfg_sim_device * const sim = userp;
+	const struct bfg_sim_protocol * const proto = sim->proto;
+	struct timeval tv_timeout;
+	fd_set rfds;
+	size_t input_size;
+	ssize_t r;
+
+	pthread_detach(pthread_self());
+	RenameThread("simulator");
+
+	while (true)
+	{
+		FD_ZERO(&rfds);
+		FD_SET(sim->masterfd, &rfds);
+		// Only block waiting for the host when there is nothing to hash
+		tv_timeout = (struct timeval){ .tv_sec = sim->working ? 0 : 1, };
+		if (select(sim->masterfd + 1, &rfds, NULL, NULL, &tv_timeout) > 0)
+		{
+			if (sim->jobbuflen && timer_elapsed_us(&sim->tv_last_recv, NULL) > BFG_SIM_PARTIAL_JOB_TIMEOUT_US)
+				sim->jobbuflen = 0;
+			input_size = proto->input_size(sim);
+			r = read(sim->masterfd, &sim->jobbuf[sim->jobbuflen], input_size - sim->jobbuflen);
+			if (r > 0)
+			{
+				timer_set_now(&sim->tv_last_recv);
+				sim->jobbuflen += r;
+				if (sim->jobbuflen == input_size)
+				{
+					sim->jobbuflen = 0;
+					proto->input(sim, sim->jobbuf);
+				}
+			}
+			else
+			if (r < 0 && errno != EINTR && errno != EAGAIN)
+				// The host side is probably closed; wait for it to come back
+				cgsleep_ms(100);
+		}
+		if (sim->working)
+			bfg_sim_hash(sim);
+	}
+	return NULL;
+}
+
+static
+bool bfg_sim_device_start(const struct bfg_sim_protocol * const proto, const unsigned latency_ms, const float error_percent, const double hashrate)
+{
+	struct bfg_sim_device * const sim = malloc(sizeof(*sim));
+	struct termios tios;
+	pthread_t pth;
+	char *scanstr;
+
+	*sim = (struct bfg_sim_device){
+		.proto = proto,
+		.latency_ms = latency_ms,
+		.error_percent = error_percent,
+		.hashrate = hashrate,
+		.slavefd = -1,
+	};
+	sim->masterfd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (sim->masterfd == -1)
+		goto err;
+	if (grantpt(sim->masterfd) || unlockpt(sim->masterfd) || !ptsname(sim->masterfd))
+		goto err;
+	sim->devpath = strdup(ptsname(sim->masterfd));
+
+	// Keep the slave side open, so the master doesn't hang up between host opens
+	sim->slavefd = open(sim->devpath, O_RDWR | O_NOCTTY);
+	if (sim->slavefd == -1)
+		goto err;
+	if (!tcgetattr(sim->slavefd, &tios))
+	{
+		cfmakeraw(&tios);
+		tcsetattr(sim->slavefd, TCSANOW, &tios);
+	}
+
+	if (unlikely(pthread_create(&pth, NULL, bfg_sim_thread, sim)))
+		goto err;
+
+	scanstr = malloc(strlen(proto->dname) + 1 + strlen(sim->devpath) + 1);
+	sprintf(scanstr, "%s:%s", proto->dname, sim->devpath);
+	string_elist_add(scanstr, &scan_devices);
+	free(scanstr);
+	applog(LOG_DEBUG, "Simulating %s device on %s", proto->name, sim->devpath);
+	return true;
+
+err:
+	if (sim->slavefd != -1)
+		close(sim->slavefd);
+	if (sim->masterfd != -1)
+		close(sim->masterfd);
+	free(sim->devpath);
+	free(sim);
+	return false;
+}
+
+// Parses <protocol>:<count>[:<latency ms>[:<error percent>[:<hashrate>]]]
+char *bfg_simulator_add(const char * const arg)
+{
+	const struct bfg_sim_protocol *proto;
+	unsigned latency_ms = 0;
+	float error_percent = 0;
+	double hashrate = 0;
+	char name[0x10];
+	int count;
+
+	if (sscanf(arg, "%15[^:]:%d:%u:%f:%lf", name, &count, &latency_ms, &error_percent, &hashrate) < 2 || count < 1)
+		return "Invalid simulated device specification";
+	for (proto = bfg_sim_protocols; proto->name; ++proto)
+		if (!strcasecmp(proto->name, name))
+			break;
+	if (!proto->name)
+		return "Unknown simulated device protocol";
+
+	for (int i = 0; i < count; ++i)
+		if (!bfg_sim_device_start(proto, latency_ms, error_percent, hashrate))
+			return "Failed to create simulated device";
+	return NULL;
+}
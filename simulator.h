@@ -0,0 +1,19 @@
+#ifndef BFG_SIMULATOR_H
+#define BFG_SIMULATOR_H
+
+#ifdef USE_ICARUS
+#define BFG_SIM_PROTOCOL_ICARUS_HELP " icarus"
+#else
+#define BFG_SIM_PROTOCOL_ICARUS_HELP ""
+#endif
+#ifdef USE_BITFORCE
+#define BFG_SIM_PROTOCOL_BITFORCE_HELP " bitforce"
+#else
+#define BFG_SIM_PROTOCOL_BITFORCE_HELP ""
+#endif
+// Lists only the protocols built in
+#define BFG_SIM_PROTOCOLS_HELP  "(protocols:" BFG_SIM_PROTOCOL_ICARUS_HELP BFG_SIM_PROTOCOL_BITFORCE_HELP ")"
+
+extern char *bfg_simulator_add(const char *arg);
+
+#endif
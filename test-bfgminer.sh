@@ -1,3 +1,7 @@
 #!/bin/sh
 echo $PATH
-bfgminer --unittest --no-default-config --scan noauto -d?
+bfgminer --unittest --no-default-config --scan noauto -d? || exit 1
+# Simulated devices must answer the real driver detection (golden nonce) probes
+# Skipped when built without the simulator or the icarus driver
+bfgminer --help | tr -d '\n' | grep -q -- '--simulate.*(protocols:[^)]*icarus' || exit 0
+bfgminer --no-default-config --scan noauto --simulate icarus:2 --set-device icarus:probe_timeout=5 -d? 2>&1 | grep -q '2 devices listed'
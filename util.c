@@ -73,6 +73,7 @@ struct data_buffer {
 	void		*buf;
 	size_t		len;
 	curl_socket_t	*idlemarker;
+	size_t		allocsz;
 };
 
 struct upload_buffer {
@@ -150,14 +151,22 @@ static size_t all_data_cb(const void *ptr, size_t size, size_t nmemb,
 
 	newlen = oldlen + len;
 
-	newmem = realloc(db->buf, newlen + 1);
+	// Grow geometrically, so multi-megabyte GBT templates don't get copied for every chunk received
+	if (newlen + 1 > db->allocsz)
+	{
+		size_t newsz = db->allocsz ? db->allocsz : 0x1000;
+		while (newsz < newlen + 1)
+			newsz *= 2;
+		newmem = realloc(db->buf, newsz);
 #ifdef DEBUG_DATABUF
-	applog(LOG_DEBUG, "data_buffer_write realloc(%p, %lu) => %p", db->buf, (long unsigned)(newlen + 1), newmem);
+		applog(LOG_DEBUG, "data_buffer_write realloc(%p, %lu) => %p", db->buf, (long unsigned)newsz, newmem);
 #endif
-	if (!newmem)
-		return 0;
+		if (!newmem)
+			return 0;
+		db->buf = newmem;
+		db->allocsz = newsz;
+	}
 
-	db->buf = newmem;
 	db->len = newlen;
 	memcpy(db->buf + oldlen, ptr, len);
 	memcpy(db->buf + newlen, &zero, 1);	/* null terminate */
@@ -388,6 +397,23 @@ void set_cloexec_socket(SOCKETTYPE sock, const bool cloexec)
 #endif
 }
 
+void set_nonblocking(SOCKETTYPE sock, const bool nonblocking)
+{
+#ifdef WIN32
+	u_long flags = nonblocking;
+	ioctlsocket(sock, FIONBIO, &flags);
+#else
+	const int curflags = fcntl(sock, F_GETFL, 0);
+	int flags = curflags;
+	if (nonblocking)
+		flags |= O_NONBLOCK;
+	else
+		flags &= ~O_NONBLOCK;
+	if (flags != curflags)
+		fcntl(sock, F_SETFL, flags);
+#endif
+}
+
 int json_rpc_call_sockopt_cb(void __maybe_unused *userdata, curl_socket_t fd,
 			     curlsocktype __maybe_unused purpose)
 {
@@ -2706,6 +2732,7 @@ static bool parse_notify(struct pool *pool, json_t *val)
 		hex2bin(&bytes_buf(&pool->swork.merkle_bin)[i * 32], json_string_value(json_array_get(arr, i)), 32);
 	pool->swork.merkles = merkles;
 	pool->nonce2 = 0;
+	++pool->swork.generation;
 	
 	memcpy(pool->swork.target, pool->next_target, 0x20);
 	
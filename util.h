@@ -159,6 +159,7 @@ struct cgpu_info;
 
 
 extern void set_cloexec_socket(SOCKETTYPE, bool cloexec);
+extern void set_nonblocking(SOCKETTYPE, bool nonblocking);
 
 static inline
 SOCKETTYPE bfg_socket(const int domain, const int type, const int protocol)